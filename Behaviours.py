@@ -85,4 +85,35 @@ class Bsinwave(Behavior):
         self.value = self.constant + self.amp*math.sin(time.time()*self.freq+self.phase)
 
     def __str__(self):
-        return "Bsinwave"
\ No newline at end of file
+        return "Bsinwave"
+
+
+class VectorizedBehavior:
+    # Opt-in: the class is not instantiated per channel. All the channels of a
+    # server using it are updated by a single call per tick, on NumPy arrays
+    # with one row per channel (params: channels x parameters as floats, NaN
+    # if missing; values: the current values).
+    vectorized = True
+
+    @classmethod
+    def updateValues(cls, params, values):
+        # returns the new values (one per channel), or updates 'values' in place
+        return values
+
+    @classmethod
+    def setValues(cls, params, values, index, value):
+        # write from a master on the channel of row 'index'
+        values[index] = value
+
+
+class Bsetpoints(VectorizedBehavior):
+    # Bsetpoint for many channels: constant, range
+
+    @classmethod
+    def updateValues(cls, params, values):
+        import numpy as np
+        return params[:, 0] + np.random.uniform(-params[:, 1], params[:, 1])
+
+    @classmethod
+    def setValues(cls, params, values, index, value):
+        params[index, 0] = value
@@ -0,0 +1,127 @@
+#include "log_.h"
+#include "time_.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include <algorithm>
+
+using namespace CEXCP;
+
+namespace CUTIL {
+
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+/*                                    cLog                                   */
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+
+std::atomic<int> cLog::FLevel(llInfo);
+std::atomic<uint64_t> cLog::FDropped(0);
+std::vector<cLog::cRing*> cLog::FRings;
+cMutex cLog::FRingsLock;
+cLog* cLog::FFlusher=nullptr;
+thread_local cLog::cHolder cLog::FHolder;
+
+/*===========================================================================*/
+cLog::cLog(int fd, unsigned period):cThread(),FFd(fd),FPeriod(period),FRunning(true){ }
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! The ring is left to the flusher (and the next thread).
+cLog::cHolder::~cHolder(){ if (ring) ring->owned.store(false,std::memory_order_release); }
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! "debug", "info", "warning", "error" or "off" (default: info).
+cLogLevel cLog::level(const std::string &name){
+ if (name=="debug") return llDebug;
+ if (name=="warning") return llWarning;
+ if (name=="error") return llError;
+ if (name=="off") return llOff;
+ return llInfo;
+}
+
+/*===========================================================================*/
+//! Calling thread's ring: taken once (first message) among the released ones
+//! or allocated; rings are never freed.
+cLog::cRing* cLog::ring(){ cRing *r=nullptr; bool owned=false;
+ if (FHolder.ring) return FHolder.ring;
+ FRingsLock.lock();
+ for (size_t i=0; i<FRings.size() && !r; i++)
+  if (FRings[i]->owned.compare_exchange_strong(owned,true,std::memory_order_acquire)) r=FRings[i];
+  else owned=false;
+ if (!r) FRings.push_back(r=new cRing());
+ FRingsLock.unlock();
+ return FHolder.ring=r;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+void cLog::write(int level, const char *format, ...){ cRing *r=ring(); cRecord *rec;
+timespec ts; va_list args; int n; unsigned head=r->head.load(std::memory_order_relaxed);
+ if (head-r->tail.load(std::memory_order_acquire)>=szRing){
+  FDropped.fetch_add(1,std::memory_order_relaxed); return; }
+ rec=r->records+(head&(szRing-1));
+ clock_gettime(CLOCK_REALTIME,&ts); // vDSO
+ rec->time=static_cast<uint64_t>(ts.tv_sec)*1000000000ULL+ts.tv_nsec;
+ rec->level=static_cast<uint8_t>(level);
+ va_start(args,format); n=vsnprintf(rec->text,szText,format,args); va_end(args);
+ rec->length=static_cast<uint8_t>(n<0?0:n>=szText?szText-1:n);
+ r->head.store(head+1,std::memory_order_release);
+}
+
+/*===========================================================================*/
+//! Flushes every 'period' ms to 'fd' (not closed) until '::stop'.
+void cLog::start(int fd, unsigned period){
+ FRingsLock.lock();
+ if (!FFlusher){ FFlusher=new cLog(fd,period); FFlusher->execute(); }
+ FRingsLock.unlock();
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Writes what is still in the rings and ends the flusher thread (woken up,
+//! no need to wait for the end of its period).
+void cLog::stop(){ cLog *flusher;
+ FRingsLock.lock(); flusher=FFlusher; FFlusher=nullptr; FRingsLock.unlock();
+ if (!flusher) return;
+ flusher->lock(); flusher->FRunning=false; flusher->sendSignal(flusher->FWake);
+ flusher->unlock();
+ flusher->wait(); delete flusher;
+}
+
+/*===========================================================================*/
+void cLog::OnExecute(){ timespec end;
+ lock();
+ while (FRunning){
+  end=cTimeSpec(); end.tv_nsec+=FPeriod%1000*1000000L; end.tv_sec+=FPeriod/1000;
+  if (end.tv_nsec>=1000000000L){ end.tv_sec++; end.tv_nsec-=1000000000L; }
+  waitForSignal(FWake,end); // timed sleep
+  unlock(); flushRings(); lock();
+ }
+ unlock();
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Flusher thread only (consumer of every ring).
+void cLog::flushRings(){ static const char levels[]="DIWE"; char stamp[32];
+std::vector<std::pair<cRing*,unsigned> > taken; unsigned head, tail; size_t done; ssize_t n;
+ FRingsLock.lock(); // records available now ....................................
+ for (cRing *r: FRings){ head=r->head.load(std::memory_order_acquire);
+  tail=r->tail.load(std::memory_order_relaxed);
+  for (; tail!=head; tail++) FBatch.push_back(r->records+(tail&(szRing-1)));
+  taken.push_back(std::make_pair(r,head)); }
+ FRingsLock.unlock();
+ std::stable_sort(FBatch.begin(),FBatch.end(),
+  [](const cRecord *a, const cRecord *b){ return a->time<b->time; });
+ FOut.clear();
+ for (const cRecord *rec: FBatch){ // "<s.us> <level> <text>\n" .................
+  n=snprintf(stamp,sizeof(stamp),"%llu.%06llu %c ",
+   static_cast<unsigned long long>(rec->time/1000000000ULL),
+   static_cast<unsigned long long>(rec->time%1000000000ULL/1000),
+   levels[rec->level<4?rec->level:3]);
+  FOut.insert(FOut.end(),stamp,stamp+n);
+  FOut.insert(FOut.end(),rec->text,rec->text+rec->length);
+  FOut.push_back('\n'); }
+ FBatch.clear();
+ for (auto &t: taken) t.first->tail.store(t.second,std::memory_order_release);
+ for (done=0; done<FOut.size(); done+=n) // ......................................
+  if ((n=::write(FFd,FOut.data()+done,FOut.size()-done))<=0) break;
+}
+
+}
@@ -0,0 +1,88 @@
+/**
+ * @file log_.h
+ */
+
+#ifndef _LOG_ //###############################################################
+#define _LOG_
+
+#include "thread_.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unistd.h> // STDOUT_FILENO
+
+namespace CUTIL {
+
+enum cLogLevel { llDebug=0, llInfo=1, llWarning=2, llError=3, llOff=4 };
+
+//! Logs a printf-like message. A disabled level costs one compare: the
+//! arguments are not even evaluated, e.g: CLOG(llDebug,"read %u bytes",n);
+#define CLOG(level,...) do { if (CUTIL::cLog::enabled(level)) \
+ CUTIL::cLog::write(level,__VA_ARGS__); } while (0)
+
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+/*                                    cLog                                   */
+/*! \author Francisco Neves                                                  */
+/*! \date 2026.10.17 ( Last modified 2026.10.17 )                            */
+/*! \brief Asynchronous logger (per thread lock-free rings)                  */
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+//! \details
+//! ** '::write' formats the message in a fixed size record of the calling
+//!   thread's ring (single producer, single consumer: no lock, no syscall,
+//!   no allocation once the thread has its ring). Longer messages are
+//!   truncated; when the ring is full the message is dropped and counted
+//!   (see '::dropped'): logging never blocks the caller.
+//! ** The flusher thread ('::start') empties the rings every 'period' ms,
+//!   orders the records by time and writes them with a single write(2), one
+//!   compact line each: "<s.us> <D|I|W|E> <message>".
+//! ** Rings of finished threads are reused by the new ones.
+//! ** Until '::start' (or after '::stop') records are kept in the rings.
+class cLog: protected cThread {
+public: enum cSizes { szText=112, szRing=1024 }; // szRing must be a power of 2.
+private: //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+    struct cRecord { uint64_t time; uint8_t level; uint8_t length; char text[szText]; };
+    struct cRing {
+        cRecord records[szRing];
+        std::atomic<unsigned> head, tail; // free-running, [tail,head[ to flush.
+        std::atomic<bool> owned;
+        cRing():head(0),tail(0),owned(true){ }
+    };
+    struct cHolder { cRing *ring; cHolder():ring(nullptr){ } ~cHolder(); };
+    static std::atomic<int> FLevel;
+    static std::atomic<uint64_t> FDropped;
+    static std::vector<cRing*> FRings;
+    static cMutex FRingsLock;
+    static cLog *FFlusher;
+    static thread_local cHolder FHolder;
+    int FFd; unsigned FPeriod;
+    bool FRunning;
+    cConditionalWaiting FWake;
+    std::vector<cRecord*> FBatch;
+    std::vector<char> FOut;
+    //.........................................................................
+    explicit cLog(int fd, unsigned period);
+    static cRing* ring();
+    void flushRings();
+    //.........................................................................
+    void OnStart(){ }
+    void OnExecute();
+    void OnStop(){ flushRings(); }
+public: //:::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+    virtual ~cLog(){ }
+    //.........................................................................
+    static inline bool enabled(int level){
+     return level>=FLevel.load(std::memory_order_relaxed); }
+    static inline void setLevel(cLogLevel level){ FLevel.store(level,std::memory_order_relaxed); }
+    static inline cLogLevel level(){ return static_cast<cLogLevel>(FLevel.load(std::memory_order_relaxed)); }
+    static cLogLevel level(const std::string &name);
+    static inline uint64_t dropped(){ return FDropped.load(std::memory_order_relaxed); }
+    //.........................................................................
+    static void write(int level, const char *format, ...) __attribute__((format(printf,2,3)));
+    static void start(int fd=STDOUT_FILENO, unsigned period=100);
+    static void stop();
+};
+
+}
+
+#endif // _LOG_ ###############################################################
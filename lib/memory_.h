@@ -8,6 +8,10 @@
 #include "exception_.h"
 #include "constanst_.h"
 
+#include <new>
+#include <utility>
+#include <vector>
+
 namespace CMATH {
 
 //! cAllocate     : (Re)Allocate memory block.
@@ -19,6 +23,7 @@ namespace CMATH {
 //! cByteSwap(V)  : Returns The litle/big indian representation of 'V'.
 //! cCopy(D,S,sz) : Copy 'sz' items from 'S' to 'D'
 //! cDelete       : delete and null a pointer.
+//! cPool         : Pool of fixed-size objects (no heap allocation once warm).
 //! cRealloc      : Reallocate a memory block.
 
 //! Build a 16 or 32 bits integer .
@@ -138,6 +143,45 @@ T bff=cAllocate(size,buffer); // See: NULL && 0 behaviour.
  else buffer=bff;
 }
 
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+/*                                    cPool                                  */
+/*! \author Francisco Neves                                                  */
+/*! \date 2026.10.17 ( Last modified 2026.10.17 )                            */
+/*! \brief Pool of fixed-size objects (not thread safe)                      */
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+//! \details
+//! ** Slots are allocated in blocks of 'BlockSize' on demand and only given
+//!   back to the heap by the destructor; released slots are reused first
+//!   (LIFO free list), so a warm pool costs no heap allocation, e.g:
+//!   cPool<cItem> pool; cItem *i=pool.acquire(args...); pool.release(i);
+//! ** Objects not released when the pool is destroyed are not destructed.
+template <class T, unsigned BlockSize=64> class cPool {
+private: //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+    union cSlot { cSlot *next; alignas(T) unsigned char data[sizeof(T)]; };
+    std::vector<cSlot*> FBlocks;
+    cSlot *FFree;
+    unsigned FnAcquired;
+    cPool(cPool&){ } //> disable.
+    void grow(){ cSlot *b=new cSlot[BlockSize]; FBlocks.push_back(b);
+     for (unsigned i=BlockSize; i-->0; ){ b[i].next=FFree; FFree=b+i; } }
+public: //:::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+    explicit cPool():FFree(nullptr),FnAcquired(0){ }
+    virtual ~cPool(){ for (cSlot *b: FBlocks) delete[] b; }
+    //.........................................................................
+    template <class... Args> T* acquire(Args&&... args){ cSlot *s; T *t;
+     if (!FFree) grow();
+     s=FFree; FFree=s->next;
+     try { t=new (s->data) T(std::forward<Args>(args)...); }
+     catch (...){ s->next=FFree; FFree=s; throw; }
+     FnAcquired++; return t; }
+    void release(T *t){ cSlot *s=reinterpret_cast<cSlot*>(t);
+     if (!t) return;
+     t->~T(); s->next=FFree; FFree=s; FnAcquired--; }
+    //.........................................................................
+    inline unsigned acquired(){ return FnAcquired; }
+    inline unsigned capacity(){ return FBlocks.size()*BlockSize; }
+};
+
 }
 
 #endif // _MEMORY_ ############################################################ 
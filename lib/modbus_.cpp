@@ -1,11 +1,24 @@
 #include <modbus_.h>
+#include <log_.h>
 
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h> // memset
+#include <sys/resource.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <stddef.h> // offsetof
 
 #include "net_.h"
 
+#define EPOLL_MAXEVENTS 256 // events handled per 'epoll_wait'
+#define URING_ENTRIES 4096  // submission ring size (clamped by the kernel)
+#define URING_BUFFERS 1024  // provided buffers (szRx/2 bytes each)
+#define UDP_BATCH 64        // datagrams per 'recvmmsg'/'sendmmsg'
+#define UDP_RCVBUF (1<<20)  // receive buffer (bursts of many pollers)
+
 
 using namespace CEXCP;
 using namespace CMATH;
@@ -13,62 +26,725 @@ using namespace CMATH;
 namespace CUTIL {
 //using namespace CUTIL;
 
+std::vector<int> cMODBUSServer::FInherited;
+cMutex cMODBUSServer::FInheritedLock;
+
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+/*                               cMODBUSStats                                */
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+
+/*===========================================================================*/
+unsigned cMODBUSStats::slot(uint8_t function){
+ switch (function){
+  case MODBUS_FC_READ_COILS: case MODBUS_FC_READ_DISCRETE_INPUTS:
+  case MODBUS_FC_READ_HOLDING_REGISTERS: case MODBUS_FC_READ_INPUT_REGISTERS:
+  case MODBUS_FC_WRITE_SINGLE_COIL: case MODBUS_FC_WRITE_SINGLE_REGISTER: return function-1;
+  case MODBUS_FC_WRITE_MULTIPLE_COILS: return 6;
+  case MODBUS_FC_WRITE_MULTIPLE_REGISTERS: return 7;
+  case MODBUS_FC_MASK_WRITE_REGISTER: return 8;
+  case MODBUS_FC_WRITE_AND_READ_REGISTERS: return 9;
+  default: return 10;
+ }
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+const char* cMODBUSStats::name(unsigned slot){
+static const char *names[nSlots]={"FC01","FC02","FC03","FC04","FC05","FC06",
+ "FC15","FC16","FC22","FC23","other"};
+ return slot<nSlots?names[slot]:"?";
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Adds 's' (recorded by any thread) to this one (written by the caller).
+void cMODBUSStats::merge(const cMODBUSStats &s){
+ receive.merge(s.receive);
+ for (unsigned i=0; i<nSlots; i++) for (unsigned j=0; j<nStages; j++)
+  latency[i][j].merge(s.latency[i][j]);
+ add(requests,s.requests.load(std::memory_order_relaxed));
+ add(rxBytes,s.rxBytes.load(std::memory_order_relaxed));
+ add(txBytes,s.txBytes.load(std::memory_order_relaxed));
+ add(errors,s.errors.load(std::memory_order_relaxed));
+ add(exceptions,s.exceptions.load(std::memory_order_relaxed));
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Latency line of a histogram (us): "<label> n= p50= p99= p999= max=".
+static std::string cLatencyLine(const std::string &label, const cHistogram &h){
+char line[160];
+ snprintf(line,sizeof(line),"%s n=%llu p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus",
+  label.c_str(),static_cast<unsigned long long>(h.count()),h.percentile(50)/1e3,
+  h.percentile(99)/1e3,h.percentile(99.9)/1e3,h.max()/1e3);
+ return line;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! One line for the counters, then one per non empty histogram.
+std::vector<std::string> cMODBUSStats::report() const {
+static const char *stages[nStages]={"dispatch","reply"};
+std::vector<std::string> lines; char line[160];
+ snprintf(line,sizeof(line),"requests=%llu rx=%lluB tx=%lluB errors=%llu exceptions=%llu",
+  static_cast<unsigned long long>(requests.load(std::memory_order_relaxed)),
+  static_cast<unsigned long long>(rxBytes.load(std::memory_order_relaxed)),
+  static_cast<unsigned long long>(txBytes.load(std::memory_order_relaxed)),
+  static_cast<unsigned long long>(errors.load(std::memory_order_relaxed)),
+  static_cast<unsigned long long>(exceptions.load(std::memory_order_relaxed)));
+ lines.push_back(line);
+ if (receive.count()) lines.push_back(cLatencyLine("receive",receive));
+ for (unsigned i=0; i<nSlots; i++) for (unsigned j=0; j<nStages; j++)
+  if (latency[i][j].count())
+   lines.push_back(cLatencyLine(std::string(name(i))+" "+stages[j],latency[i][j]));
+ return lines;
+}
+
 /*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
 /*                              cModBusServer                                */
 /*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
 
 /*===========================================================================*/
+//! 'FStopped' is cleared by 'connect_*' (not here) so that a '::disconnect'
+//! issued before the thread runs is not lost.
 void cMODBUSServer::OnStart(){
- FStopped=false; FSelfPipe[0]=FSelfPipe[1]=ssUndefined;
+ FSelfPipe[0]=FSelfPipe[1]=ssUndefined;
+ for (cMODBUSServer *w: FWorkers) w->execute(); // SO_REUSEPORT workers.
 }
 
-void cMODBUSServer::OnRequest(unsigned req_length){
-  std::cout << "OnRequest " << req_length << std::endl;
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! A drained server ('::drain') lets its workers end by themselves.
+void cMODBUSServer::OnStop(){
+ if (FStopped) for (cMODBUSServer *w: FWorkers) w->disconnect();
+ for (cMODBUSServer *w: FWorkers) w->wait();
+ close();
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Workers forward requests to the owner (which is the one inherited).
+void cMODBUSServer::OnRequest(const uint8_t *req, unsigned req_length){
+  if (FOwner){ FOwner->OnRequest(req,req_length); return; }
+  CLOG(llDebug,"OnRequest %u",req_length);
+
+}
 
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Called by '::writePDU' with the 'value' a mask write (FC22) committed to
+//! the holding register 'address', inside its critical section: the mapping
+//! is read directly (not through the seqlock). Workers forward it.
+void cMODBUSServer::OnMaskWrite(int address, uint16_t value){
+  if (FOwner) FOwner->OnMaskWrite(address,value);
 }
 
 /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
-//! 'OnExecute' will block on 'select' until it detects activity on one of the
-//! file descriptor sets (including FSockect). '::disconnect' write dummy data
-//! to 'FSocket' to unblock 'select'
+//! Runs the event loop selected at construction (see 'cMODBUSReactor').
 void cMODBUSServer::OnExecute(){
-int rc, fdmax, master_socket; fd_set refset, rdset;
+ if (FBackEnd==mbRTU){ executeRTU(); return; } // serial line.
+ if (FBackEnd==mbUDP){ executeUDP(); return; } // datagrams.
+ switch (FReactor){
+  case mrUring: executeUring(); break;
+  case mrEpoll: executeEpoll(); break;
+  default: executeSelect();
+ }
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Raise the descriptors limit up to the hard limit (10k+ clients).
+static inline void cRaiseNoFileLimit(){ rlimit rl;
+ if (getrlimit(RLIMIT_NOFILE,&rl)==0 && rl.rlim_cur<rl.rlim_max){
+  rl.rlim_cur=rl.rlim_max; setrlimit(RLIMIT_NOFILE,&rl); }
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! 'executeSelect' will block on 'select' until it detects activity on one of
+//! the file descriptor sets (including FSockect). '::disconnect' write dummy
+//! data to 'FSocket' to unblock 'select'. Connections with replies pending
+//! are watched for writing instead of reading (see '::writable').
+void cMODBUSServer::executeSelect(){
+int fdmax, master_socket; fd_set refset, rdset, wrset;
 struct timeval tv={0,0};
  // Clear the reference set of socket ; Add the server socket.
  FD_ZERO(&refset); FD_SET(FSocket,&refset);
+ FReadSet=&refset; FD_ZERO(&FWriteSet);
  fdmax=FSocket; // Keep track of the max file descriptor
  selfPipeTrick(fdmax,refset); // add a self-pipe to safely '::disconnet'
-
+ adopted(&refset,&fdmax); // handed over by the previous process, if any.
 
  //............................................................................
  for (; !FStopped; ){ // Searching for existing connections +++++++++++++++++++
   tv={FTimeOut,0}; // is modified in select (returns remaining time).
+  if (FIdleTimeOut) tv={0,static_cast<suseconds_t>(FWheel.tick())*1000};
 
-  if (select(fdmax+1,&(rdset=refset),nullptr,nullptr,&tv)==-1) continue; // skip
-  if (FD_ISSET(FSelfPipe[0], &rdset)) break; // see '::disconnet'
+  if (select(fdmax+1,&(rdset=refset),&(wrset=FWriteSet),nullptr,&tv)==-1) continue; // skip
+  FNow=cMilliseconds();
+  if (FD_ISSET(FSelfPipe[0], &rdset)){ // see '::disconnet' and '::drain'
+   if (awake(&refset,&fdmax)) break; else continue; }
   // Run through existing connections looking for data to be read/new connections
   for (master_socket=0; master_socket<=fdmax && !FStopped; master_socket++){
-   if (!FD_ISSET(master_socket,&rdset)) continue;
+   if (!FD_ISSET(master_socket,&rdset) && !FD_ISSET(master_socket,&wrset)) continue;
    if (master_socket==FSocket){ // A client is asking a new connection ........
     socklen_t addrlen; struct sockaddr_in clientaddr; int newfd;
     addrlen=sizeof(clientaddr); memset(&clientaddr,0, sizeof(clientaddr));
-    newfd=accept(FSocket,(struct sockaddr*)&clientaddr,&addrlen);
-    if (newfd!=-1){ // Handle new connection ..................................
+    newfd=accept4(FSocket,(struct sockaddr*)&clientaddr,&addrlen,SOCK_NONBLOCK|SOCK_CLOEXEC);
+    if (newfd!=-1 && newfd>=FD_SETSIZE){ reject(newfd); newfd=-1; }
+    if (newfd!=-1 && admit(newfd)){ // Handle new connection ..................
      FD_SET(newfd,&refset); // Add new descriptor to set.
      if (newfd>fdmax) fdmax=newfd; // keep track of maximum.
+     open_connection(newfd);
      start_connection(clientaddr,newfd); // accepted
     } else start_connection(clientaddr,-1); // rejected.
-   } else { //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
-    modbus_set_socket(FContext, master_socket);
-    rc=modbus_receive(FContext,FQuery);
-    if (rc>0){ 
-      OnRequest(static_cast<unsigned>(rc));
-      reply(static_cast<unsigned>(rc));
-    } // Reply to request.
-    else if (rc==-1){ // End connection and remove reference set ..............
-     ::close(master_socket); FD_CLR(master_socket,&refset); // Remove from
-     if (master_socket==fdmax) fdmax--; // keep track of maximum.
- } } } } // Socket is not shutdown while reading/writing.
+   } else if (!serve(*FConnections[master_socket])){ //++++++++++++++++++++++++
+    // End connection and remove reference set ................................
+    close_connection(master_socket); FD_CLR(master_socket,&refset); // Remove
+    if (master_socket==fdmax) fdmax--; // keep track of maximum.
+  } }
+  expire(&refset);
+  if (drained()) break;
+ } // Socket is not shutdown while reading/writing.
+ FReadSet=nullptr;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Edge-triggered epoll reactor. Only descriptors with pending activity are
+//! visited, so the cost per event does not depend on the number of clients.
+//! As for 'executeSelect', '::disconnect' unblocks 'epoll_wait' by writing to
+//! the self-pipe (see '::selfPipeTrick').
+void cMODBUSServer::executeEpoll(){
+int n, fd, flags; epoll_event ev, events[EPOLL_MAXEVENTS];
+ cRaiseNoFileLimit();
+ if ((FEpoll=epoll_create1(EPOLL_CLOEXEC))==-1) throw Exception
+  ("Invalid Operation",cTypeID(THIS,__FUNCTION__),"epoll_create1");
+ // listen socket must be non-blocking to drain 'accept' (edge-triggered) ....
+ if ((flags=fcntl(FSocket,F_GETFL))==-1) throw Exception
+  ("invalid operation",cTypeID(THIS,__FUNCTION__),"fcntl(F_GETFL)");
+ if (fcntl(FSocket,F_SETFL,flags|O_NONBLOCK)==-1) throw Exception
+  ("invalid operation",cTypeID(THIS,__FUNCTION__),"fcntl(F_SETFL)");
+ ev.events=EPOLLIN|EPOLLET; ev.data.fd=FSocket;
+ if (epoll_ctl(FEpoll,EPOLL_CTL_ADD,FSocket,&ev)==-1) throw Exception
+  ("Invalid Operation",cTypeID(THIS,__FUNCTION__),"epoll_ctl(EPOLL_CTL_ADD)");
+ selfPipeTrick(FEpoll); // add a self-pipe to safely '::disconnet'
+ adopted(); // handed over by the previous process, if any.
+ //............................................................................
+ for (; !FStopped; ){
+  n=epoll_wait(FEpoll,events,EPOLL_MAXEVENTS,FIdleTimeOut?
+   static_cast<int>(FWheel.tick()):static_cast<int>(FTimeOut)*1000);
+  FNow=cMilliseconds();
+  for (int i=0; i<n && !FStopped; i++){ // n==-1 (e.g. EINTR) is skipped
+   if ((fd=events[i].data.fd)==FSelfPipe[0]){ // see '::disconnet', '::drain'
+    if (awake()) break;
+   } else if (fd==FSocket) acceptEpoll();
+   else if (connection(fd)) receiveEpoll(fd); // (unless handed over)
+  }
+  expire();
+  if (drained()) break;
+ }
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Accept every pending connection (edge-triggered: until EAGAIN).
+void cMODBUSServer::acceptEpoll(){
+socklen_t addrlen; struct sockaddr_in clientaddr; int newfd; epoll_event ev;
+ for (; !FStopped; ){
+  addrlen=sizeof(clientaddr); memset(&clientaddr,0, sizeof(clientaddr));
+  newfd=accept4(FSocket,(struct sockaddr*)&clientaddr,&addrlen,SOCK_NONBLOCK|SOCK_CLOEXEC);
+  if (newfd==-1){ // accept queue is empty or the connection is rejected ......
+   if (errno==EINTR) continue;
+   if (errno!=EAGAIN && errno!=EWOULDBLOCK) start_connection(clientaddr,-1);
+   return;
+  }
+  if (!admit(newfd)){ start_connection(clientaddr,-1); continue; } // rejected.
+  ev.events=EPOLLIN|EPOLLRDHUP|EPOLLET; ev.data.fd=newfd;
+  if (epoll_ctl(FEpoll,EPOLL_CTL_ADD,newfd,&ev)==-1){
+   clients()--; ::close(newfd); start_connection(clientaddr,-1); // rejected.
+  } else { open_connection(newfd); start_connection(clientaddr,newfd); }
+ }
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Serve every request already queued on 'socket' (edge-triggered: there is
+//! no new event for data that was left unread, see '::serve'), or resume a
+//! pending send (EPOLLOUT, see '::writable').
+void cMODBUSServer::receiveEpoll(int socket){
+ if (!serve(*FConnections[socket])) close_connection(socket);
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! RTU serving loop: the (non-blocking) serial line is read as soon as bytes
+//! arrive and a timerfd, re-armed on each read, expires after a 3.5 chars
+//! silence, which ends the frame (see '::serveRTU'). Frame timing does not
+//! depend on libmodbus timeouts, so the reply latency is the gap plus the
+//! serving time. A frame longer than MODBUS_RTU_MAX_ADU_LENGTH is dropped.
+void cMODBUSServer::executeRTU(){
+cMODBUSConnection line(FSocket); uint64_t expirations; ssize_t n; bool overflow=false;
+itimerspec gap={{0,0},{FRTUGap/1000000000L,FRTUGap%1000000000L}};
+ if ((FTimer=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC))==-1) throw
+  Exception("Invalid Operation",cTypeID(THIS,__FUNCTION__),"timerfd_create");
+ selfPipe(); // to safely '::disconnet'
+ pollfd fds[3]={{FSocket,POLLIN,0},{FTimer,POLLIN,0},{FSelfPipe[0],POLLIN,0}};
+ //............................................................................
+ for (; !FStopped; ){
+  if (poll(fds,3,-1)<=0) continue; // e.g. EINTR.
+  FNow=cMilliseconds();
+  if (fds[2].revents && awake()) break; // see '::disconnet' (not handed over)
+  // silence (checked 1st: bytes read now belong to the next frame) .........
+  if ((fds[1].revents&POLLIN) && read(FTimer,&expirations,sizeof(expirations))>0){
+   if (!overflow) serveRTU(line); else cMODBUSStats::add(FStats.errors,1);
+   line.head=line.tail=0; overflow=false;
+  }
+  if (!(fds[0].revents&(POLLIN|POLLERR|POLLHUP))) continue;
+  for (; ; ){ // drain the line ................................................
+   if ((n=read(FSocket,line.rx+line.head,cMODBUSConnection::szRx-line.head))>0){
+    line.rxBytes+=n; line.lastActivity=FNow; cMODBUSStats::add(FStats.rxBytes,n);
+    if ((line.head+=n)>MODBUS_RTU_MAX_ADU_LENGTH){ overflow=true; line.head=0; }
+    continue;
+   }
+   if (n==-1 && errno==EINTR) continue;
+   if (n==-1 && errno!=EAGAIN && errno!=EWOULDBLOCK) // line error (e.g. hangup)
+    poll(fds+2,1,static_cast<int>(FTimeOut)*1000); // .. wait before retrying.
+   break;
+  }
+  if (line.head || overflow) timerfd_settime(FTimer,0,&gap,nullptr); // re-armed.
+ }
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! CRC-16/MODBUS (polynomial 0xA001 reflected, initial value 0xFFFF).
+static inline uint16_t cCRC16(const uint8_t *buffer, unsigned length){
+uint16_t crc=0xFFFF;
+ for (const uint8_t *end=buffer+length; buffer<end; buffer++){ crc^=*buffer;
+  for (unsigned i=0; i<8; i++) crc=(crc&1)?(crc>>1)^0xA001:crc>>1; }
+ return crc;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Serves the RTU frame in 'c' (from offset 0): frames that are too short,
+//! with a bad CRC or addressed to another slave are dropped without reply.
+void cMODBUSServer::serveRTU(cMODBUSConnection &c){
+const uint8_t *req=c.rx; unsigned length=c.head; uint16_t crc;
+ if (length<4){ cMODBUSStats::add(FStats.errors,1); return; }
+ crc=cCRC16(req,length-2);
+ if (req[length-2]!=(crc&0xFF) || req[length-1]!=(crc>>8)){
+  cMODBUSStats::add(FStats.errors,1); return; }
+ if (req[0]!=FRTUServerID && req[0]!=MODBUS_BROADCAST_ADDRESS) return;
+ c.nRequests++; c.txLength=request(req,length,c.tx,cMODBUSConnection::szTx);
+ for (pollfd pfd={c.socket,POLLOUT,0}; flush(c) && c.pending(); ) // line is ours.
+  if (poll(&pfd,1,static_cast<int>(FTimeOut)*1000)<=0){
+   cMODBUSStats::add(FStats.errors,1); c.txLength=c.txSent=0; }
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! A received datagram and its reply (see '::executeUDP').
+struct cMODBUSDatagram {
+ sockaddr_storage addr; iovec rxIov, txIov;
+ uint8_t rx[MODBUS_TCP_MAX_ADU_LENGTH], tx[MODBUS_TCP_MAX_ADU_LENGTH];
+};
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Modbus/UDP serving loop: the (non-blocking) socket is drained by batches
+//! of up to UDP_BATCH datagrams with one 'recvmmsg', and the replies of a
+//! batch are sent to their senders with one 'sendmmsg', so that a burst of
+//! requests from many pollers costs two syscalls per batch. A datagram must
+//! hold exactly one MBAP frame, otherwise it is dropped; as for any UDP
+//! server, replies that do not fit the socket buffer are dropped as well.
+void cMODBUSServer::executeUDP(){
+std::unique_ptr<cMODBUSDatagram[]> dgrams(new cMODBUSDatagram[UDP_BATCH]);
+mmsghdr rx[UDP_BATCH], tx[UDP_BATCH]; int n, m, i, r; unsigned length; uint64_t t;
+ selfPipe(); // to safely '::disconnet'
+ pollfd fds[2]={{FSocket,POLLIN,0},{FSelfPipe[0],POLLIN,0}};
+ memset(rx,0,sizeof(rx)); memset(tx,0,sizeof(tx));
+ for (i=0; i<UDP_BATCH; i++){ cMODBUSDatagram &d=dgrams[i];
+  d.rxIov={d.rx,sizeof(d.rx)}; rx[i].msg_hdr.msg_iov=&d.rxIov; rx[i].msg_hdr.msg_iovlen=1;
+  tx[i].msg_hdr.msg_iovlen=1; }
+ //............................................................................
+ for (; !FStopped; ){
+  fds[0].fd=FDrain.load()==drNone?FSocket:-1; // not read while draining.
+  if (poll(fds,2,-1)<=0) continue; // e.g. EINTR.
+  if (fds[1].revents && (awake() || drained())) break; // '::disconnet', '::drain'
+  if (!(fds[0].revents&POLLIN)) continue;
+  do { // drain the socket ....................................................
+   for (i=0; i<UDP_BATCH; i++){ // reset (modified by 'recvmmsg').
+    rx[i].msg_hdr.msg_name=&dgrams[i].addr;
+    rx[i].msg_hdr.msg_namelen=sizeof(dgrams[i].addr); rx[i].msg_hdr.msg_flags=0; }
+   t=cNanoseconds();
+   if ((n=recvmmsg(FSocket,rx,UDP_BATCH,MSG_DONTWAIT,nullptr))==-1 && errno==EINTR) continue;
+   if (n>0) FStats.receive.record(cNanoseconds()-t);
+   for (i=m=0; i<n; i++){ cMODBUSDatagram &d=dgrams[i]; // serve the batch ...
+    length=rx[i].msg_len; cMODBUSStats::add(FStats.rxBytes,length);
+    if ((rx[i].msg_hdr.msg_flags&MSG_TRUNC) || length<8 ||
+     length!=6u+((d.rx[4]<<8)|d.rx[5])){ // not one MBAP frame.
+     cMODBUSStats::add(FStats.errors,1); continue; }
+    if (!(d.txIov.iov_len=request(d.rx,length,d.tx,sizeof(d.tx)))) continue;
+    d.txIov.iov_base=d.tx; tx[m].msg_hdr.msg_iov=&d.txIov;
+    tx[m].msg_hdr.msg_name=&d.addr; tx[m++].msg_hdr.msg_namelen=rx[i].msg_hdr.msg_namelen;
+   }
+   for (i=0; i<m; i+=r) // send the replies (skipping a failed one) ..........
+    if ((r=sendmmsg(FSocket,tx+i,m-i,0))<=0){
+     if ((r=(r==-1 && errno==EINTR)?0:1)) cMODBUSStats::add(FStats.errors,1); }
+    else for (int j=i; j<i+r; j++) cMODBUSStats::add(FStats.txBytes,tx[j].msg_len);
+  } while (n==UDP_BATCH && !FStopped);
+ }
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Operation and socket of an io_uring request (see 'io_uring_sqe::user_data').
+enum cURingOp { uoWake=1, uoAccept, uoRecv, uoSend, uoTick };
+static inline uint64_t cURingData(cURingOp op, int fd){
+ return (static_cast<uint64_t>(op)<<32)|static_cast<uint32_t>(fd);
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Completion based reactor: a multishot accept, one provided-buffer receive
+//! armed per connection (re-armed once its frames are served) and one send
+//! per connection in flight. Everything queued while handling a batch of
+//! completions (sends, receives) is submitted by the same 'io_uring_enter'
+//! that waits for the next batch, so a busy server makes about one syscall
+//! per batch instead of a few per request. Falls back to 'executeEpoll' if
+//! io_uring (or provided buffer rings, Linux 5.19) is not available.
+void cMODBUSServer::executeUring(){
+io_uring_cqe *cqe; uint64_t data; int res, fd; unsigned flags;
+ cRaiseNoFileLimit();
+ try { FURing=new cURing(URING_ENTRIES,URING_BUFFERS,cMODBUSConnection::szRx/2); }
+ catch (Exception&){ FURing=nullptr; executeEpoll(); return; } // fallback.
+ selfPipeTrick(*FURing); // add a self-pipe to safely '::disconnet'
+ acceptUring();
+ if (FIdleTimeOut) tickUring();
+ adopted(); // handed over by the previous process, if any.
+ //............................................................................
+ for (; !FStopped; ){
+  FURing->submit(true); // -1 (e.g. EINTR) is skipped
+  FNow=cMilliseconds();
+  while (!FStopped && (cqe=FURing->peek())){
+   data=cqe->user_data; res=cqe->res; flags=cqe->flags; FURing->advance();
+   fd=static_cast<int>(data&0xFFFFFFFF);
+   switch (static_cast<cURingOp>(data>>32)){
+    case uoWake: if (!awake()) wakeUring(); break; // '::disconnet', '::drain'
+    case uoAccept:
+     if (res>=0){ sockaddr_in clientaddr; socklen_t addrlen=sizeof(clientaddr);
+      memset(&clientaddr,0,sizeof(clientaddr));
+      getpeername(res,(struct sockaddr*)&clientaddr,&addrlen);
+      if (admit(res)){ open_connection(res); start_connection(clientaddr,res);
+       receiveUring(*FConnections[res]);
+      } else start_connection(clientaddr,-1); // rejected.
+     } else if (res!=-EINTR && res!=-EAGAIN && res!=-ECANCELED){ // canceled by '::awake'
+      sockaddr_in clientaddr;
+      memset(&clientaddr,0,sizeof(clientaddr)); start_connection(clientaddr,-1); }
+     if (!(flags&IORING_CQE_F_MORE) && res!=-ECANCELED && FDrain.load()==drNone)
+      acceptUring(); // re-arm (unless draining, see '::awake').
+     break;
+    case uoTick: expire(); tickUring(); break;
+    case uoRecv: receivedUring(*FConnections[fd],res,flags); break;
+    case uoSend: sentUring(*FConnections[fd],res); break;
+  } }
+  if (drained()) break;
+ }
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+void cMODBUSServer::acceptUring(){ io_uring_sqe *sqe=FURing->get();
+ sqe->opcode=IORING_OP_ACCEPT; sqe->fd=FSocket; sqe->ioprio=IORING_ACCEPT_MULTISHOT;
+ sqe->accept_flags=SOCK_CLOEXEC; sqe->user_data=cURingData(uoAccept,FSocket);
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Re-arms the (one shot) poll on the self-pipe (see '::selfPipeTrick').
+void cMODBUSServer::wakeUring(){ io_uring_sqe *sqe=FURing->get();
+ sqe->opcode=IORING_OP_POLL_ADD; sqe->fd=FSelfPipe[0];
+ sqe->poll32_events=POLLIN; sqe->user_data=cURingData(uoWake,FSelfPipe[0]);
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Wakes the loop every 'FWheel' tick (see '::expire').
+void cMODBUSServer::tickUring(){ io_uring_sqe *sqe=FURing->get();
+ FTick.tv_sec=FWheel.tick()/1000; FTick.tv_nsec=(FWheel.tick()%1000)*1000000LL;
+ sqe->opcode=IORING_OP_TIMEOUT; sqe->addr=reinterpret_cast<uint64_t>(&FTick);
+ sqe->len=1; sqe->user_data=cURingData(uoTick,-1);
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! The kernel picks one of the provided buffers when data arrives, so idle
+//! connections hold no receive buffer.
+void cMODBUSServer::receiveUring(cMODBUSConnection &c){ io_uring_sqe *sqe=FURing->get();
+ sqe->opcode=IORING_OP_RECV; sqe->fd=c.socket; sqe->flags=IOSQE_BUFFER_SELECT;
+ sqe->buf_group=cURing::bgid; sqe->user_data=cURingData(uoRecv,c.socket);
+ c.nPending++;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Sends the coalesced replies unless a send is already in flight (replies
+//! are then appended after it and sent on its completion, see '::sentUring').
+void cMODBUSServer::sendUring(cMODBUSConnection &c){ io_uring_sqe *sqe;
+ if (c.txSending || !c.txLength) return;
+ sqe=FURing->get(); sqe->opcode=IORING_OP_SEND; sqe->fd=c.socket;
+ sqe->addr=reinterpret_cast<uint64_t>(c.tx); sqe->len=c.txSending=c.txLength;
+ sqe->msg_flags=MSG_NOSIGNAL; sqe->user_data=cURingData(uoSend,c.socket);
+ c.nPending++;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! The connection is only released once no request refers to it anymore
+//! ('shutdown' completes the pending ones), so that its socket (the key of
+//! the completions) cannot be reused meanwhile.
+void cMODBUSServer::closeUring(cMODBUSConnection &c){
+ c.closing=true;
+ if (c.nPending) shutdown(c.socket,SHUT_RDWR); else close_connection(c.socket);
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Copies the received bytes to the connection ring buffer (there is always
+//! room for a provided buffer: at most a partial frame is left unread) and
+//! serves the complete frames. The receive is re-armed unless the reply
+//! buffer is full ('blocked' until the send in flight completes).
+void cMODBUSServer::receivedUring(cMODBUSConnection &c, int res, unsigned flags){
+const unsigned mask=cMODBUSConnection::szRx-1; unsigned bid, at, n; int r;
+ c.nPending--;
+ if (flags&IORING_CQE_F_BUFFER){ bid=flags>>IORING_CQE_BUFFER_SHIFT;
+  if (res>0){ at=c.head&mask; n=cMin(static_cast<unsigned>(res),mask+1-at);
+   memcpy(c.rx+at,FURing->buffer(bid),n); memcpy(c.rx,FURing->buffer(bid)+n,res-n);
+   c.head+=res; c.rxBytes+=res; c.lastActivity=FNow; cMODBUSStats::add(FStats.rxBytes,res); }
+  FURing->recycle(bid);
+ }
+ if (c.closing){ if (!c.nPending) close_connection(c.socket); return; }
+ if (res==-ENOBUFS || res==-EINTR){ receiveUring(c); return; } // retry.
+ if (res<=0 || (r=frames(c))<0){ closeUring(c); return; } // closed or error.
+ sendUring(c);
+ if (r==0) receiveUring(c); else c.blocked=true;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Drops the bytes sent (a short send is completed by the next one), serves
+//! the frames left unread by a 'blocked' connection and sends the replies
+//! coalesced meanwhile.
+void cMODBUSServer::sentUring(cMODBUSConnection &c, int res){ int r;
+ c.nPending--;
+ if (res>0){ memmove(c.tx,c.tx+res,c.txLength-=res); c.txBytes+=res; c.lastActivity=FNow;
+  cMODBUSStats::add(FStats.txBytes,res); }
+ c.txSending=0;
+ if (c.closing){ if (!c.nPending) close_connection(c.socket); return; }
+ if (res<=0){ closeUring(c); return; }
+ if (c.blocked){
+  if ((r=frames(c))<0){ closeUring(c); return; }
+  if (r==0){ c.blocked=false; receiveUring(c); }
+ }
+ sendUring(c);
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! The self-pipe is readable: returns true if '::disconnect'. Otherwise a
+//! '::drain' request is served here: the listening socket is not watched
+//! anymore (it lives on in the new process, pending clients wait in its
+//! accept queue) and, if requested, every idle connection (no partial frame,
+//! no reply pending) is given away. io_uring connections are never given
+//! away: a receive is always in flight and could consume the next request.
+//! The listening socket is closed once the drain is committed, or watched
+//! again, with the connections given back, if canceled (see '::commitDrain'
+//! and '::cancelDrain'). 'refset' and 'fdmax' are those of 'select', if any.
+bool cMODBUSServer::awake(fd_set *refset, int *fdmax){
+char dummy; int drain, fd; epoll_event ev;
+ while (read(FSelfPipe[0],&dummy,1)>0); // (non-blocking)
+ if (FStopped) return true;
+ if ((drain=FDrain.load())==drDraining){ // committed ........................
+  if (FSocket!=ssUndefined && FBackEnd!=mbRTU){
+   ::close(FSocket); FSocket=ssUndefined; FUnixPath.clear(); } // not ours anymore.
+  return false;
+ }
+ if (drain==drResume){ // canceled: accepting again ...........................
+  if (FSocket!=ssUndefined && FBackEnd!=mbRTU){
+   if (FEpoll!=ssUndefined){ ev.events=EPOLLIN|EPOLLET; ev.data.fd=FSocket;
+    epoll_ctl(FEpoll,EPOLL_CTL_ADD,FSocket,&ev); } // (reports a pending client)
+   if (refset) FD_SET(FSocket,refset);
+   if (FURing) acceptUring();
+  }
+  adopted(refset,fdmax); // the connections given back.
+  lock(); FDrain=drNone; sendSignal(FDrained); unlock(); // see '::cancelDrain'
+  return false;
+ }
+ if (drain!=drAccept && drain!=drHandover) return false;
+ if (FSocket!=ssUndefined && FBackEnd!=mbRTU){ // stop accepting ...........
+  if (FEpoll!=ssUndefined) epoll_ctl(FEpoll,EPOLL_CTL_DEL,FSocket,nullptr);
+  if (refset) FD_CLR(FSocket,refset);
+  if (FURing){ io_uring_sqe *sqe=FURing->get(); // multishot accept.
+   sqe->opcode=IORING_OP_ASYNC_CANCEL; sqe->addr=cURingData(uoAccept,FSocket); }
+ }
+ if (drain==drHandover && !FURing) for (cMODBUSConnection *c: FConnections){
+  if (!c || c->available() || c->pending()) continue;
+  if ((fd=fcntl(c->socket,F_DUPFD_CLOEXEC,0))==-1) continue;
+  // epoll keeps watching a socket while it is open (the duplicate) .........
+  if (FEpoll!=ssUndefined) epoll_ctl(FEpoll,EPOLL_CTL_DEL,c->socket,nullptr);
+  if (refset) FD_CLR(c->socket,refset);
+  FHanded.push_back(fd); close_connection(c->socket); // the peer sees nothing.
+ }
+ lock(); FDrain=drHanded; sendSignal(FDrained); unlock(); // see '::drain'
+ return false;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! True once drained (and the connections given away collected by '::drain'):
+//! the loop then ends ('::OnStop').
+bool cMODBUSServer::drained(){
+ return FDrain.load()==drDraining && !FConnectionPool.acquired();
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Serves the connections given to '::adopt' as if they were just accepted.
+//! 'refset' and 'fdmax' are those of 'select', if any.
+void cMODBUSServer::adopted(fd_set *refset, int *fdmax){
+sockaddr_in peer; socklen_t length; epoll_event ev; int flags;
+ for (int fd: FAdopted){
+  length=sizeof(peer); memset(&peer,0,sizeof(peer));
+  getpeername(fd,(struct sockaddr*)&peer,&length);
+  if ((flags=fcntl(fd,F_GETFL))!=-1) fcntl(fd,F_SETFL,flags|O_NONBLOCK);
+  if (refset && fd>=FD_SETSIZE){ reject(fd); start_connection(peer,-1); continue; }
+  if (!admit(fd)){ start_connection(peer,-1); continue; } // rejected.
+  if (FEpoll!=ssUndefined){ ev.events=EPOLLIN|EPOLLRDHUP|EPOLLET; ev.data.fd=fd;
+   if (epoll_ctl(FEpoll,EPOLL_CTL_ADD,fd,&ev)==-1){
+    clients()--; ::close(fd); start_connection(peer,-1); continue; }
+  }
+  if (refset){ FD_SET(fd,refset); if (fd>*fdmax) *fdmax=fd; }
+  open_connection(fd); start_connection(peer,fd);
+  if (FURing) receiveUring(*FConnections[fd]);
+ }
+ FAdopted.clear();
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+void cMODBUSServer::open_connection(int socket){
+ if (FConnections.size()<=static_cast<size_t>(socket)) FConnections.resize(socket+1,nullptr);
+ FConnections[socket]=FConnectionPool.acquire(socket);
+ FConnections[socket]->lastActivity=FNow;
+ if (FIdleTimeOut) FWheel.schedule(FConnections[socket]->timer,FNow+FIdleTimeOut*1000ULL);
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Admission control (see 'setMaxConnections'): counts 'socket' as a client
+//! of the server (all workers) or rejects it (see '::reject') if the limit is
+//! reached. Returns false if rejected.
+bool cMODBUSServer::admit(int socket){
+ if (clients().fetch_add(1,std::memory_order_relaxed)<FMaxConnections || !FMaxConnections) return true;
+ clients().fetch_sub(1,std::memory_order_relaxed); reject(socket); return false;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Cheap reject path: no state is allocated and the socket is reset (SO_LINGER
+//! 0: RST instead of FIN, no TIME_WAIT left behind).
+void cMODBUSServer::reject(int socket){
+linger l={1,0};
+ setsockopt(socket,SOL_SOCKET,SO_LINGER,&l,sizeof(l)); ::close(socket);
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Closes the connections idle for 'FIdleTimeOut'; the others are scheduled
+//! again from their last activity (which is just recorded on each I/O).
+//! 'refset' is the 'select' reference set, if any.
+void cMODBUSServer::expire(fd_set *refset){
+ if (!FIdleTimeOut) return;
+ FWheel.advance(FNow,[this,refset](cTimerWheel::cNode &n){
+  cMODBUSConnection &c=*static_cast<cMODBUSConnection*>(n.data);
+  uint64_t deadline=c.lastActivity+FIdleTimeOut*1000ULL;
+  if (deadline>FNow){ FWheel.schedule(n,deadline); return; }
+  if (FURing){ closeUring(c); return; } // completes pending requests first.
+  if (refset) FD_CLR(c.socket,refset);
+  close_connection(c.socket);
+ });
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Closing the socket also removes it from 'FEpoll'. 'end_connection' is
+//! called before the connection is released, so that its counters can still
+//! be read (see 'connection').
+void cMODBUSServer::close_connection(int socket){
+ if (FConnections[socket]->writing && FReadSet) FD_CLR(socket,&FWriteSet);
+ FWheel.cancel(FConnections[socket]->timer); clients()--;
+ ::close(socket); end_connection(socket);
+ FConnectionPool.release(FConnections[socket]); FConnections[socket]=nullptr;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Drains the (non-blocking) socket into the connection ring buffer, serves
+//! every complete MBAP frame in it (see '::frames') and sends all the replies
+//! at once (see '::flush'). If they cannot all be sent and the reply buffer
+//! is full, the connection is neither read nor served anymore until its
+//! socket is writable (see '::writable'): the frames left are served then.
+//! Returns false if the connection is closed by the peer or is in error.
+bool cMODBUSServer::serve(cMODBUSConnection &c){
+const unsigned mask=cMODBUSConnection::szRx-1;
+iovec iov[2]; unsigned at, room; ssize_t n; int r; uint64_t t; bool more=true;
+ for (; ; ){
+  for (; (r=frames(c))>0; ) // reply buffer full: sent, or resumed once writable.
+   if (!flush(c)) return false; else if (c.pending()){ writable(c,true); return true; }
+  if (r<0) return false; // no MBAP.
+  if (!more || FStopped) break;
+  at=c.head&mask; room=cMODBUSConnection::szRx-c.available();
+  iov[0].iov_base=c.rx+at; iov[0].iov_len=cMin(room,mask+1-at);
+  iov[1].iov_base=c.rx; iov[1].iov_len=room-iov[0].iov_len;
+  t=cNanoseconds();
+  if ((n=readv(c.socket,iov,iov[1].iov_len?2:1))==0) return false; // closed.
+  if (n==-1){
+   if (errno==EINTR) continue;
+   if (errno==EAGAIN || errno==EWOULDBLOCK) break; // drained.
+   cMODBUSStats::add(FStats.errors,1); return false;
+  }
+  FStats.receive.record(cNanoseconds()-t);
+  c.rxBytes+=n; c.lastActivity=FNow; cMODBUSStats::add(FStats.rxBytes,n);
+  c.head+=n; more=static_cast<unsigned>(n)==room; // else drained (no EAGAIN).
+ }
+ if (!flush(c)) return false;
+ writable(c,c.pending()!=0); return true;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Serves the complete MBAP frames of the connection ring buffer while the
+//! reply buffer has room for one more reply; a partial frame is kept for the
+//! next call. Frames are parsed in place unless they wrap around the ring
+//! (they are then copied to the connection 'query'). Returns -1 if a frame is not MBAP, 1 if stopped
+//! because the reply buffer is full and 0 otherwise.
+int cMODBUSServer::frames(cMODBUSConnection &c){
+const unsigned mask=cMODBUSConnection::szRx-1; const uint8_t *req; unsigned at, length;
+ for (; c.available()>=7; c.tail+=length){
+  length=6+((c.at(4)<<8)|c.at(5));
+  if (length<8 || length>MODBUS_TCP_MAX_ADU_LENGTH){ // no MBAP.
+   cMODBUSStats::add(FStats.errors,1); return -1; }
+  if (c.available()<length) break; // partial frame.
+  if (c.txLength+MODBUS_TCP_MAX_ADU_LENGTH>cMODBUSConnection::szTx && c.txSent){
+   memmove(c.tx,c.tx+c.txSent,c.txLength-=c.txSent); c.txSent=0; } // unsent tail.
+  if (c.txLength+MODBUS_TCP_MAX_ADU_LENGTH>cMODBUSConnection::szTx) return 1;
+  if ((at=c.tail&mask)+length<=mask+1) req=c.rx+at; // contiguous.
+  else { for (unsigned i=0; i<length; i++) c.query[i]=c.at(i); req=c.query; }
+  c.nRequests++;
+  c.txLength+=request(req,length,c.tx+c.txLength,cMODBUSConnection::szTx-c.txLength);
+ }
+ return 0;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Sends the coalesced replies in one go, without waiting: if the socket
+//! buffer is full, the unsent tail is kept (tx[txSent,txLength[) and sent
+//! again once the socket is writable (see '::serve'). Returns false if the
+//! replies could not be sent (the connection is in error).
+bool cMODBUSServer::flush(cMODBUSConnection &c){
+ssize_t n;
+ while (c.pending()){
+  if ((n=FBackEnd==mbRTU?write(c.socket,c.tx+c.txSent,c.pending()):
+   send(c.socket,c.tx+c.txSent,c.pending(),MSG_NOSIGNAL))>0){
+   c.txSent+=n; c.txBytes+=n; cMODBUSStats::add(FStats.txBytes,n); continue; }
+  if (n==-1 && errno==EINTR) continue;
+  if (n==-1 && (errno==EAGAIN || errno==EWOULDBLOCK)) return true; // pending.
+  cMODBUSStats::add(FStats.errors,1); c.txLength=c.txSent=0; return false;
+ }
+ c.txLength=c.txSent=0; return true;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Watches (on) or not anymore the writability of a connection with replies
+//! pending (see '::flush'): epoll adds EPOLLOUT, 'select' moves the socket
+//! from its read set to its write set (level-triggered: a client that does
+//! not read is not read either, its requests wait in its own socket).
+void cMODBUSServer::writable(cMODBUSConnection &c, bool on){
+epoll_event ev;
+ if (c.writing==on) return;
+ c.writing=on;
+ if (FEpoll!=ssUndefined){
+  ev.events=EPOLLIN|EPOLLRDHUP|EPOLLET|(on?EPOLLOUT:0); ev.data.fd=c.socket;
+  epoll_ctl(FEpoll,EPOLL_CTL_MOD,c.socket,&ev);
+ } else if (FReadSet){
+  if (on){ FD_CLR(c.socket,FReadSet); FD_SET(c.socket,&FWriteSet); }
+  else { FD_CLR(c.socket,&FWriteSet); FD_SET(c.socket,FReadSet); }
+ }
 }
 
 /*===========================================================================*/
@@ -80,6 +756,7 @@ void cMODBUSServer::config(){
   if (modbus_set_slave(context(),0)==-1) throw CEXCP::Exception
     ("Fail to set slave ID",CEXCP::cTypeID(THIS,__FUNCTION__),"modbus_set_slave");
   //mb_mapping = modbus_mapping_new(5,0,0,0);
+  if (FOwner){ mb_mapping=FOwner->getMapping(); return; } // shared.
 
   mb_mapping = modbus_mapping_new_start_address(0, max_coil, 0, max_discrete, 0, max_register, 0, max_input);
   if (mb_mapping==NULL) throw CEXCP::Exception("Failed to allocate the mapping",
@@ -91,21 +768,260 @@ void cMODBUSServer::config(){
 
 }
 
-void cMODBUSServer::reply(unsigned req_length){
- lock(); //####################################################################
- modbus_reply(context(),query(),req_length,mb_mapping);
- unlock(); //##################################################################
+//! Reads are served lock-free: natively for TCP (see '::readPDU', the reply
+//! is appended to the connection ones) or from a consistent snapshot (see
+//! '::snapshot'); everything else may write the mapping and is done by
+//! 'modbus_reply' under 'mappingLock'. 'modbus_reply' writes to 'FCapture'
+//! (see '::capture'), its reply is appended as well. The caller ensures there
+//! is room for one more reply (see '::frames').
+void cMODBUSServer::reply(cMODBUSConnection &c, const uint8_t *req, unsigned req_length){
+ c.txLength+=reply(req,req_length,c.tx+c.txLength,cMODBUSConnection::szTx-c.txLength);
 }
 
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Writes into 'rsp' (at least MODBUS_TCP_MAX_ADU_LENGTH bytes, see 'size')
+//! the reply to 'req'. Returns its length (0: no reply, e.g. RTU broadcast).
+unsigned cMODBUSServer::reply(const uint8_t *req, unsigned req_length, uint8_t *rsp, unsigned size){
+modbus_mapping_t snap; unsigned n; int rc; ssize_t m; uint16_t crc;
+ if (FBackEnd==mbRTU && req[0]!=MODBUS_BROADCAST_ADDRESS){ //...................
+  if ((n=readPDU(req+1,rsp+1))>0 || (n=writePDU(req+1,req_length-3,rsp+1))>0){
+   rsp[0]=req[0]; crc=cCRC16(rsp,n+1); // slave id; CRC (low byte 1st).
+   rsp[n+1]=crc&0xFF; rsp[n+2]=crc>>8;
+   return n+3;
+ } } else if (FBackEnd!=mbRTU){ //.............................................
+  if ((n=readPDU(req+FHeaderLength,rsp+FHeaderLength))>0 ||
+   (n=writePDU(req+FHeaderLength,req_length-FHeaderLength,rsp+FHeaderLength))>0){
+   rsp[0]=req[0]; rsp[1]=req[1]; // MBAP: transaction id.
+   rsp[2]=rsp[3]=0;              // MBAP: protocol id.
+   rsp[4]=(n+1)>>8; rsp[5]=(n+1)&0xFF; rsp[6]=req[6]; // length; unit id.
+   return FHeaderLength+n;
+ } }
+ if (snapshot(req,snap)) rc=modbus_reply(context(),req,req_length,&snap);
+ else {
+  mappingLock().writeLock(); //################################################
+  rc=modbus_reply(context(),req,req_length,mb_mapping);
+  mappingLock().writeUnlock(); //##############################################
+ }
+ if (rc>0 && (m=recv(FCapture[1],rsp,size,MSG_DONTWAIT))>0 &&
+  (FBackEnd!=mbRTU || req[0]!=MODBUS_BROADCAST_ADDRESS))
+  return m; // no reply to RTU broadcasts.
+ return 0;
+}
 
 /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
-//! Implements the self-pipe trick to be able to safely exit 'select'
-void cMODBUSServer::selfPipeTrick(int &fdmax, fd_set &refset){
+//! Serves 'req': '::OnRequest' then '::reply' (into 'rsp'), recording both
+//! latencies and the counters of this worker (see '::statistics'). Invalid
+//! requests are answered by '::exception' alone. Returns the reply length.
+unsigned cMODBUSServer::request(const uint8_t *req, unsigned length, uint8_t *rsp, unsigned size){
+unsigned slot=cMODBUSStats::slot(req[FHeaderLength]), n; uint64_t t0, t1, t2; int e;
+ t0=cNanoseconds();
+ if ((e=exception(req,length,rsp))>=0){ n=e; t1=t0; }
+ else { OnRequest(req,length); t1=cNanoseconds(); n=reply(req,length,rsp,size); }
+ t2=cNanoseconds();
+ if (e<0) FStats.latency[slot][cMODBUSStats::stDispatch].record(t1-t0);
+ FStats.latency[slot][cMODBUSStats::stReply].record(t2-t1);
+ cMODBUSStats::add(FStats.requests,1);
+ if (n>static_cast<unsigned>(FHeaderLength) && (rsp[FHeaderLength]&0x80))
+  cMODBUSStats::add(FStats.exceptions,1);
+ return n;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! True if [addr,addr+nb[ is a valid read (or write) of a table [start,start+size[.
+static inline bool cValidRead(int addr, int nb, int max, int start, int size){
+ return nb>=1 && nb<=max && addr>=start && addr+nb<=start+size;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Checks 'req' up front, as 'modbus_reply' would, against the sizes of the
+//! tables only (set once by '::config': neither the tables nor any lock are
+//! touched): function code (01 ILLEGAL_FUNCTION), quantity, byte count and
+//! frame length (03 ILLEGAL_DATA_VALUE), then address range (02
+//! ILLEGAL_DATA_ADDRESS). Returns -1 if 'req' is to be served, otherwise
+//! encodes the exception reply into 'rsp' and returns its length (0 for an
+//! RTU broadcast).
+int cMODBUSServer::exception(const uint8_t *req, unsigned length, uint8_t *rsp){
+const uint8_t *pdu=req+FHeaderLength; uint8_t fc=pdu[0]; uint16_t crc;
+unsigned size=length-FHeaderLength-(FBackEnd==mbRTU?2:0), expected=5; // PDU.
+int addr=0, nb=0, max=1, start=0, count=0, wAddr, wNb, code=-1;
+ if (size>=5){ addr=(pdu[1]<<8)|pdu[2]; nb=(pdu[3]<<8)|pdu[4]; }
+ switch (fc){
+  case MODBUS_FC_READ_COILS: case MODBUS_FC_WRITE_SINGLE_COIL:
+  case MODBUS_FC_WRITE_MULTIPLE_COILS:
+   start=mb_mapping->start_bits; count=mb_mapping->nb_bits; break;
+  case MODBUS_FC_READ_DISCRETE_INPUTS:
+   start=mb_mapping->start_input_bits; count=mb_mapping->nb_input_bits; break;
+  case MODBUS_FC_READ_INPUT_REGISTERS:
+   start=mb_mapping->start_input_registers; count=mb_mapping->nb_input_registers; break;
+  case MODBUS_FC_READ_HOLDING_REGISTERS: case MODBUS_FC_WRITE_SINGLE_REGISTER:
+  case MODBUS_FC_WRITE_MULTIPLE_REGISTERS: case MODBUS_FC_MASK_WRITE_REGISTER:
+  case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+   start=mb_mapping->start_registers; count=mb_mapping->nb_registers; break;
+  case MODBUS_FC_REPORT_SLAVE_ID: return -1;
+  default: code=MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+ }
+ switch (fc){ // quantity and byte count ......................................
+  case MODBUS_FC_READ_COILS: case MODBUS_FC_READ_DISCRETE_INPUTS:
+   max=MODBUS_MAX_READ_BITS; break;
+  case MODBUS_FC_READ_HOLDING_REGISTERS: case MODBUS_FC_READ_INPUT_REGISTERS:
+   max=MODBUS_MAX_READ_REGISTERS; break;
+  case MODBUS_FC_WRITE_SINGLE_COIL:
+   if (nb!=0 && nb!=0xFF00) code=MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+   nb=1; break;
+  case MODBUS_FC_WRITE_SINGLE_REGISTER: nb=1; break;
+  case MODBUS_FC_MASK_WRITE_REGISTER: nb=1; expected=7; break;
+  case MODBUS_FC_WRITE_MULTIPLE_COILS: max=MODBUS_MAX_WRITE_BITS;
+   expected=6+(nb+7)/8;
+   if (size>=6 && pdu[5]!=(nb+7)/8) code=MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+   break;
+  case MODBUS_FC_WRITE_MULTIPLE_REGISTERS: max=MODBUS_MAX_WRITE_REGISTERS;
+   expected=6+nb*2;
+   if (size>=6 && pdu[5]!=nb*2) code=MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+   break;
+  case MODBUS_FC_WRITE_AND_READ_REGISTERS: max=MODBUS_MAX_WR_READ_REGISTERS;
+   expected=10;
+   if (size<10) break;
+   wAddr=(pdu[5]<<8)|pdu[6]; wNb=(pdu[7]<<8)|pdu[8]; expected+=wNb*2;
+   if (wNb<1 || wNb>MODBUS_MAX_WR_WRITE_REGISTERS || pdu[9]!=wNb*2)
+    code=MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+   else if (!cValidRead(wAddr,wNb,wNb,start,count)) // the read range next.
+    code=MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+   break;
+ }
+ if (code<0){ // ...............................................................
+  if (size!=expected || nb<1 || nb>max)
+   code=MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+  else if (!cValidRead(addr,nb,nb,start,count))
+   code=MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+  else return -1;
+ }
+ if (FBackEnd==mbRTU){ // slave id, fc|0x80, code, CRC .......................
+  if (req[0]==MODBUS_BROADCAST_ADDRESS) return 0;
+  rsp[0]=req[0]; rsp[1]=fc|0x80; rsp[2]=code;
+  crc=cCRC16(rsp,3); rsp[3]=crc&0xFF; rsp[4]=crc>>8;
+  return 5;
+ }
+ memcpy(rsp,req,FHeaderLength); // MBAP: transaction id, protocol id, unit id.
+ rsp[4]=0; rsp[5]=3; rsp[FHeaderLength]=fc|0x80; rsp[FHeaderLength+1]=code;
+ return FHeaderLength+2;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Encodes into 'rsp' the reply PDU to the read request PDU 'req' (FC1-4)
+//! straight from the mapping (seqlock consistent). Returns the PDU length or
+//! 0 if 'req' is not a valid read, which is then left to 'modbus_reply'.
+unsigned cMODBUSServer::readPDU(const uint8_t *req, uint8_t *rsp){
+const uint8_t *bits=nullptr; const uint16_t *regs=nullptr;
+int addr, nb, max, start, size, i; unsigned bytes, seq; uint8_t *out;
+ switch (req[0]){
+  case MODBUS_FC_READ_COILS: bits=mb_mapping->tab_bits;
+   start=mb_mapping->start_bits; size=mb_mapping->nb_bits; break;
+  case MODBUS_FC_READ_DISCRETE_INPUTS: bits=mb_mapping->tab_input_bits;
+   start=mb_mapping->start_input_bits; size=mb_mapping->nb_input_bits; break;
+  case MODBUS_FC_READ_HOLDING_REGISTERS: regs=mb_mapping->tab_registers;
+   start=mb_mapping->start_registers; size=mb_mapping->nb_registers; break;
+  case MODBUS_FC_READ_INPUT_REGISTERS: regs=mb_mapping->tab_input_registers;
+   start=mb_mapping->start_input_registers; size=mb_mapping->nb_input_registers; break;
+  default: return 0;
+ }
+ addr=(req[1]<<8)|req[2]; nb=(req[3]<<8)|req[4];
+ max=bits?MODBUS_MAX_READ_BITS:MODBUS_MAX_READ_REGISTERS;
+ if (!cValidRead(addr,nb,max,start,size)) return 0; // exception by libmodbus.
+ rsp[0]=req[0]; rsp[1]=bytes=bits?(nb+7)/8:nb*2; addr-=start;
+ do { seq=mappingLock().readBegin(); out=rsp+2; // seqlock read .............
+  if (bits){ memset(out,0,bytes); // one bit per coil, LSB first.
+   for (i=0; i<nb; i++) if (bits[addr+i]) out[i>>3]|=1<<(i&7);
+  } else for (i=0; i<nb; i++){ // big-endian registers.
+   *out++=regs[addr+i]>>8; *out++=regs[addr+i]&0xFF; }
+ } while (mappingLock().readRetry(seq));
+ return 2+bytes;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Applies the mask write (FC22) or read/write multiple registers (FC23)
+//! request PDU 'req' ('length' bytes) to the holding registers in a single
+//! critical section (FC23: the write is done before the read, as required)
+//! and encodes into 'rsp' the reply PDU. Returns its length or 0 if 'req' is
+//! neither or not valid, which is then left to 'modbus_reply'.
+unsigned cMODBUSServer::writePDU(const uint8_t *req, unsigned length, uint8_t *rsp){
+uint16_t *regs=mb_mapping->tab_registers; uint16_t mAnd, mOr; uint8_t *out;
+int start=mb_mapping->start_registers, size=mb_mapping->nb_registers;
+int addr, nb, wAddr, wNb, i;
+ switch (req[0]){
+  case MODBUS_FC_MASK_WRITE_REGISTER: //.........................................
+   if (length<7) return 0;
+   addr=(req[1]<<8)|req[2]; mAnd=(req[3]<<8)|req[4]; mOr=(req[5]<<8)|req[6];
+   if (!cValidRead(addr,1,1,start,size)) return 0;
+   mappingLock().writeLock(); //###############################################
+   regs[addr-start]=(regs[addr-start]&mAnd)|(mOr&~mAnd);
+   OnMaskWrite(addr,regs[addr-start]);
+   mappingLock().writeUnlock(); //#############################################
+   memcpy(rsp,req,7); return 7; // echo.
+  case MODBUS_FC_WRITE_AND_READ_REGISTERS: //....................................
+   if (length<10) return 0;
+   addr=(req[1]<<8)|req[2]; nb=(req[3]<<8)|req[4];
+   wAddr=(req[5]<<8)|req[6]; wNb=(req[7]<<8)|req[8];
+   if (!cValidRead(addr,nb,MODBUS_MAX_WR_READ_REGISTERS,start,size) ||
+    !cValidRead(wAddr,wNb,MODBUS_MAX_WR_WRITE_REGISTERS,start,size) ||
+    req[9]!=wNb*2 || length<10u+wNb*2) return 0;
+   addr-=start; wAddr-=start; req+=10;
+   rsp[0]=MODBUS_FC_WRITE_AND_READ_REGISTERS; rsp[1]=nb*2; out=rsp+2;
+   mappingLock().writeLock(); //###############################################
+   for (i=0; i<wNb; i++) regs[wAddr+i]=(req[2*i]<<8)|req[2*i+1];
+   for (i=0; i<nb; i++){ *out++=regs[addr+i]>>8; *out++=regs[addr+i]&0xFF; }
+   mappingLock().writeUnlock(); //#############################################
+   return 2+nb*2;
+  default: return 0;
+ }
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! If 'req' is a valid read (FC1-4), copies the requested range into this
+//! worker's snapshot tables (retrying while a writer overlaps the copy) and
+//! makes 'snap' a mapping of exactly that range. Otherwise (writes, illegal
+//! ranges, etc) returns false and the live mapping must be used.
+bool cMODBUSServer::snapshot(const uint8_t *req, modbus_mapping_t &snap){
+const uint8_t *pdu=req+FHeaderLength; const void *src; void *dst;
+int addr, nb; size_t bytes; unsigned seq;
+ if (pdu[0]<MODBUS_FC_READ_COILS || pdu[0]>MODBUS_FC_READ_INPUT_REGISTERS) return false;
+ addr=(pdu[1]<<8)|pdu[2]; nb=(pdu[3]<<8)|pdu[4];
+ memset(&snap,0,sizeof(snap));
+ switch (pdu[0]){
+  case MODBUS_FC_READ_COILS: //................................................
+   if (!cValidRead(addr,nb,MODBUS_MAX_READ_BITS,
+    mb_mapping->start_bits,mb_mapping->nb_bits)) return false;
+   src=mb_mapping->tab_bits+(addr-mb_mapping->start_bits); bytes=nb;
+   dst=snap.tab_bits=FSnapBits; snap.start_bits=addr; snap.nb_bits=nb; break;
+  case MODBUS_FC_READ_DISCRETE_INPUTS: //......................................
+   if (!cValidRead(addr,nb,MODBUS_MAX_READ_BITS,
+    mb_mapping->start_input_bits,mb_mapping->nb_input_bits)) return false;
+   src=mb_mapping->tab_input_bits+(addr-mb_mapping->start_input_bits); bytes=nb;
+   dst=snap.tab_input_bits=FSnapBits; snap.start_input_bits=addr; snap.nb_input_bits=nb; break;
+  case MODBUS_FC_READ_HOLDING_REGISTERS: //....................................
+   if (!cValidRead(addr,nb,MODBUS_MAX_READ_REGISTERS,
+    mb_mapping->start_registers,mb_mapping->nb_registers)) return false;
+   src=mb_mapping->tab_registers+(addr-mb_mapping->start_registers); bytes=nb*sizeof(uint16_t);
+   dst=snap.tab_registers=FSnapRegisters; snap.start_registers=addr; snap.nb_registers=nb; break;
+  case MODBUS_FC_READ_INPUT_REGISTERS: //......................................
+   if (!cValidRead(addr,nb,MODBUS_MAX_READ_REGISTERS,
+    mb_mapping->start_input_registers,mb_mapping->nb_input_registers)) return false;
+   src=mb_mapping->tab_input_registers+(addr-mb_mapping->start_input_registers);
+   bytes=nb*sizeof(uint16_t); dst=snap.tab_input_registers=FSnapRegisters;
+   snap.start_input_registers=addr; snap.nb_input_registers=nb; break;
+  default: return false;
+ }
+ do { seq=mappingLock().readBegin(); memcpy(dst,src,bytes); } // seqlock read
+ while (mappingLock().readRetry(seq));
+ return true;
+}
+
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Creates the (non-blocking) self-pipe written by '::disconnect'.
+void cMODBUSServer::selfPipe(){
 int flags; // tmp.
  if (pipe(FSelfPipe)==-1) throw Exception("Invalid Operation",
   cTypeID(THIS,__FUNCTION__),"Fail to create self-pipe");
- FD_SET(FSelfPipe[0],&refset); // Add read end of pipe to 'refset'
- fdmax=cMax(fdmax,FSelfPipe[0]+1); // .. adjust 'fdmax' if required
  // make read end non-blocking ................................................
  if ((flags=fcntl(FSelfPipe[0],F_GETFL))==-1) throw Exception
   ("invalid operation",cTypeID(THIS,__FUNCTION__),"fcntl(F_GETFL)");
@@ -118,47 +1034,244 @@ int flags; // tmp.
   ("invalid operation",cTypeID(THIS,__FUNCTION__),"fcntl(F_SETFL)");
 }
 
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Implements the self-pipe trick to be able to safely exit 'select'
+void cMODBUSServer::selfPipeTrick(int &fdmax, fd_set &refset){
+ selfPipe();
+ FD_SET(FSelfPipe[0],&refset); // Add read end of pipe to 'refset'
+ fdmax=cMax(fdmax,FSelfPipe[0]+1); // .. adjust 'fdmax' if required
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Implements the self-pipe trick to be able to safely exit 'epoll_wait'
+void cMODBUSServer::selfPipeTrick(int epfd){
+epoll_event ev;
+ selfPipe();
+ ev.events=EPOLLIN; ev.data.fd=FSelfPipe[0]; // level-triggered.
+ if (epoll_ctl(epfd,EPOLL_CTL_ADD,FSelfPipe[0],&ev)==-1) throw Exception
+  ("Invalid Operation",cTypeID(THIS,__FUNCTION__),"epoll_ctl(EPOLL_CTL_ADD)");
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Implements the self-pipe trick to be able to safely exit 'io_uring_enter'
+//! (a poll request on the self-pipe completes on '::disconnect').
+void cMODBUSServer::selfPipeTrick(cURing &ring){
+io_uring_sqe *sqe;
+ selfPipe();
+ sqe=ring.get(); sqe->opcode=IORING_OP_POLL_ADD; sqe->fd=FSelfPipe[0];
+ sqe->poll32_events=POLLIN; sqe->user_data=cURingData(uoWake,FSelfPipe[0]);
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Binds the context to a socketpair for good: 'modbus_reply' writes its
+//! reply there (one SOCK_SEQPACKET message) and '::reply' reads it back, so
+//! libmodbus never touches the clients sockets.
+void cMODBUSServer::capture(){
+ if (socketpair(AF_UNIX,SOCK_SEQPACKET|SOCK_CLOEXEC,0,FCapture)==-1) throw Exception
+  ("Invalid Operation",cTypeID(THIS,__FUNCTION__),"socketpair");
+ modbus_set_socket(FContext,FCapture[0]);
+}
+
 /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 //! Free all associated memory, sockets, etc.
 void cMODBUSServer::close(){
- FBackEnd=mbUndefined; // tag connect[TCP|TCP_IP|RTU].
+ if (FContext && FBackEnd==mbRTU && FSocket!=ssUndefined){
+  modbus_set_socket(FContext,FSocket); FSocket=ssUndefined; // see below.
+ } else if (FContext && FCapture[0]!=ssUndefined) modbus_set_socket(FContext,-1);
+ FBackEnd=mbUndefined; // tag connect[TCP|TCP_IP|RTU|UNIX|UDP].
  if (FSocket!=ssUndefined){ ::close(FSocket); FSocket=ssUndefined; }
- if (FContext){ modbus_close(FContext); modbus_free(FContext); FContext=nullptr; }
- if (FQuery){ free(FQuery); FQuery=nullptr; }
+ if (FTimer!=ssUndefined){ ::close(FTimer); FTimer=ssUndefined; }
+ if (!FUnixPath.empty()){ // remove the socket file ..........................
+  if (FUnixPath[0]!='@') unlink(FUnixPath.c_str());
+  FUnixPath.clear(); }
+ if (FEpoll!=ssUndefined){ ::close(FEpoll); FEpoll=ssUndefined; }
+ if (FURing){ delete FURing; FURing=nullptr; } // cancels pending requests.
+ for (int &fd: FSelfPipe) if (fd!=ssUndefined){ ::close(fd); fd=ssUndefined; }
+ if (FContext){ // closes the serial line (restoring its settings) if RTU.
+  modbus_close(FContext); modbus_free(FContext); FContext=nullptr; }
+ for (int &fd: FCapture) if (fd!=ssUndefined){ ::close(fd); fd=ssUndefined; }
+ for (cMODBUSConnection *c: FConnections) if (c) close_connection(c->socket);
+ FConnections.clear();
+ for (int fd: FHanded) ::close(fd); // never collected (see '::drain').
+ for (int fd: FAdopted) ::close(fd); // never served (see '::adopt').
+ FHanded.clear(); FAdopted.clear(); FDrain=drNone;
+ for (cMODBUSServer *w: FWorkers) delete w; // already stopped (see '::OnStop')
+ FWorkers.clear();
  FHeaderLength=0; FRTUServerID=-1;
  FStopped=true;
 }
 
 /*===========================================================================*/
-cMODBUSServer::cMODBUSServer(unsigned timeout_):FSocket(ssUndefined),
-FContext(nullptr),FBackEnd(mbUndefined),FRTUServerID(-1),FHeaderLength(0),
-FTimeOut(timeout_),FQuery(nullptr),FStopped(true){
+cMODBUSServer::cMODBUSServer(unsigned timeout_, cMODBUSReactor reactor_):
+FSocket(ssUndefined),FEpoll(ssUndefined),FReadSet(nullptr),FSelfPipe{ssUndefined,ssUndefined},
+FCapture{ssUndefined,ssUndefined},FTimer(ssUndefined),FURing(nullptr),
+FContext(nullptr),FBackEnd(mbUndefined),FReactor(reactor_),FRTUServerID(-1),
+FHeaderLength(0),FRTUGap(0),FTimeOut(timeout_),FStopped(true),
+FOwner(nullptr),FWheel(256,1000),FTick{1,0},FNow(cMilliseconds()),FIdleTimeOut(0),
+FMaxConnections(0),FnClients(0),FDrain(drNone){
 
   Exception::debug=&std::cout;
  }
 
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! SO_REUSEPORT worker of 'owner_' (see 'connect_TCP').
+cMODBUSServer::cMODBUSServer(cMODBUSServer *owner_, unsigned timeout_,
+cMODBUSReactor reactor_):cMODBUSServer(timeout_,reactor_){ FOwner=owner_; }
+
 /*===========================================================================*/
 //! Create a context for TCP/IPv4; create and listen a TCP Modbus socket.
-void cMODBUSServer::connect_TCP(std::string ip, int port, int nConnect){
+//! The socket is always bound with SO_REUSEPORT (see '::listen_TCP'): with
+//! nWorkers>1, (nWorkers-1) workers listening on the same ip/port are created
+//! (see '::OnStart'), and a socket handed over ('listeners') can be joined by
+//! the workers of the next configuration.
+void cMODBUSServer::connect_TCP(std::string ip, int port, int nConnect, unsigned nWorkers){
  try { 
   
   close(); // reset and create new context ...............................
   if (!(FContext=modbus_new_tcp(ip.c_str(),port))) throw Exception
    ("Fail to create context",cTypeID(THIS,__FUNCTION__),"modbus_new_tcp");
-  if (!(FQuery=static_cast<uint8_t*>(malloc(MODBUS_TCP_MAX_ADU_LENGTH)))) throw
-   Exception("Fail to allocate memory",cTypeID(THIS,__FUNCTION__),"malloc");
 
   FHeaderLength=modbus_get_header_length(FContext);
 
   //...........................................................................
   config(); // user configuration, registers definition, etc
 
-  if ((FSocket=modbus_tcp_listen(FContext,FnConnections=nConnect))==ssError) throw
-   Exception(modbus_strerror(errno),cTypeID(THIS,__FUNCTION__),"modbus_tcp_pi_listen");
-  
+  if ((FSocket=listen_TCP(ip,port,FnConnections=nConnect))==ssError) throw
+   Exception(modbus_strerror(errno),cTypeID(THIS,__FUNCTION__),"listen_TCP");
+  for (unsigned w=1; w<nWorkers; w++) // SO_REUSEPORT workers ................
+   newWorker()->connect_TCP(ip,port,nConnect);
+  capture();
+  FBackEnd=mbTCP; FStopped=false;
+ } catch (...){ close(); throw; }
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! New (not connected) worker with the same settings (see 'FWorkers').
+cMODBUSServer* cMODBUSServer::newWorker(){
+ FWorkers.push_back(new cMODBUSServer(this,FTimeOut,FReactor));
+ FWorkers.back()->FIdleTimeOut=FIdleTimeOut;
+ FWorkers.back()->FMaxConnections=FMaxConnections;
+ return FWorkers.back();
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Equivalent to 'modbus_tcp_listen' but with SO_REUSEPORT, so that all the
+//! workers (of this process or of the next one, see '::inherit') can listen
+//! on the same ip/port.
+int cMODBUSServer::listen_TCP(std::string ip, int port, int nConnect){
+int s, enable=1, err; struct sockaddr_in addr; bool any=ip.empty()||ip=="0.0.0.0";
+ memset(&addr,0,sizeof(addr)); addr.sin_family=AF_INET; addr.sin_port=htons(port);
+ addr.sin_addr.s_addr=htonl(INADDR_ANY);
+ if (!any && inet_pton(AF_INET,ip.c_str(),&addr.sin_addr)!=1){ errno=EINVAL; return ssError; }
+ if ((s=inherited(SOCK_STREAM,(struct sockaddr*)&addr,sizeof(addr)))!=ssUndefined) return s;
+ if ((s=socket(PF_INET,SOCK_STREAM|SOCK_CLOEXEC,IPPROTO_TCP))==-1) return ssError;
+ if (
+  setsockopt(s,SOL_SOCKET,SO_REUSEADDR,&enable,sizeof(enable))!=-1 &&
+  setsockopt(s,SOL_SOCKET,SO_REUSEPORT,&enable,sizeof(enable))!=-1 &&
+  bind(s,(struct sockaddr*)&addr,sizeof(addr))!=-1 &&
+  listen(s,nConnect)!=-1) return s;
+ err=errno; ::close(s); errno=err; return ssError;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Create a (TCP) context, for the MBAP framing, and listen on the AF_UNIX
+//! stream socket 'path' ("@name" for the abstract namespace: no file left
+//! behind). Clients are served by the event loop selected at construction.
+void cMODBUSServer::connect_UNIX(std::string path, int nConnect){
+ try { close(); // reset and create new context ...............................
+  if (!(FContext=modbus_new_tcp("127.0.0.1",0))) throw Exception
+   ("Fail to create context",cTypeID(THIS,__FUNCTION__),"modbus_new_tcp");
+  FHeaderLength=modbus_get_header_length(FContext);
+  //...........................................................................
+  config(); // user configuration, registers definition, etc
+
+  if ((FSocket=listen_UNIX(path,FnConnections=nConnect))==ssError) throw
+   Exception(strerror(errno),cTypeID(THIS,__FUNCTION__),"listen_UNIX");
+  capture();
+  FBackEnd=mbUNIX; FStopped=false;
  } catch (...){ close(); throw; }
 }
 
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! A stale socket file (previous run) is replaced; any other file is not.
+int cMODBUSServer::listen_UNIX(std::string path, int nConnect){
+int s, err; struct sockaddr_un addr; struct stat st;
+ memset(&addr,0,sizeof(addr)); addr.sun_family=AF_UNIX;
+ if (path.size()<2 || path.size()>=sizeof(addr.sun_path)){ errno=EINVAL; return ssError; }
+ memcpy(addr.sun_path,path.c_str(),path.size());
+ if (path[0]=='@') addr.sun_path[0]='\0'; // abstract namespace.
+ if ((s=inherited(SOCK_STREAM,(struct sockaddr*)&addr,offsetof(sockaddr_un,sun_path)+
+  path.size()))!=ssUndefined){ FUnixPath=path; return s; } // (file kept)
+ if (path[0]!='@' && lstat(path.c_str(),&st)==0 && S_ISSOCK(st.st_mode)) unlink(path.c_str());
+ if ((s=socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0))==-1) return ssError;
+ if (bind(s,(struct sockaddr*)&addr,offsetof(sockaddr_un,sun_path)+path.size())!=-1 &&
+  listen(s,nConnect)!=-1){ FUnixPath=path; return s; }
+ err=errno; ::close(s); errno=err; return ssError;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Serves the clients of the AF_UNIX socket 'path' as well (see
+//! 'connect_UNIX'), with a worker sharing the mapping. To be called once
+//! connected (TCP) and before '::execute'.
+void cMODBUSServer::attach_UNIX(std::string path, int nConnect){
+ if (!isEnabled() || FOwner || FBackEnd==mbRTU) throw Exception("Invalid Operation",
+  cTypeID(THIS,__FUNCTION__),"Not a connected TCP server");
+ try { newWorker()->connect_UNIX(path,nConnect); }
+ catch (...){ delete FWorkers.back(); FWorkers.pop_back(); throw; }
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Create a (TCP) context, for the MBAP framing, and bind a Modbus/UDP socket.
+//! With nWorkers>1, (nWorkers-1) workers bound to the same ip/port are
+//! created (SO_REUSEPORT: the kernel spreads the senders among them).
+void cMODBUSServer::connect_UDP(std::string ip, int port, unsigned nWorkers){
+ try { close(); // reset and create new context ...............................
+  if (!(FContext=modbus_new_tcp(ip.c_str(),port))) throw Exception
+   ("Fail to create context",cTypeID(THIS,__FUNCTION__),"modbus_new_tcp");
+  FHeaderLength=modbus_get_header_length(FContext);
+  //...........................................................................
+  config(); // user configuration, registers definition, etc
+
+  if ((FSocket=listen_UDP(ip,port))==ssError) throw
+   Exception(strerror(errno),cTypeID(THIS,__FUNCTION__),"listen_UDP");
+  for (unsigned w=1; w<nWorkers; w++) // SO_REUSEPORT workers ................
+   newWorker()->connect_UDP(ip,port);
+  capture();
+  FBackEnd=mbUDP; FStopped=false;
+ } catch (...){ close(); throw; }
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Non-blocking UDP socket bound with SO_REUSEPORT (see 'listen_TCP').
+int cMODBUSServer::listen_UDP(std::string ip, int port){
+int s, enable=1, size=UDP_RCVBUF, err; struct sockaddr_in addr; bool any=ip.empty()||ip=="0.0.0.0";
+ memset(&addr,0,sizeof(addr)); addr.sin_family=AF_INET; addr.sin_port=htons(port);
+ addr.sin_addr.s_addr=htonl(INADDR_ANY);
+ if (!any && inet_pton(AF_INET,ip.c_str(),&addr.sin_addr)!=1){ errno=EINVAL; return ssError; }
+ if ((s=inherited(SOCK_DGRAM,(struct sockaddr*)&addr,sizeof(addr)))!=ssUndefined) return s;
+ if ((s=socket(PF_INET,SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC,IPPROTO_UDP))==-1) return ssError;
+ if (
+  setsockopt(s,SOL_SOCKET,SO_REUSEPORT,&enable,sizeof(enable))!=-1 &&
+  bind(s,(struct sockaddr*)&addr,sizeof(addr))!=-1){
+  setsockopt(s,SOL_SOCKET,SO_RCVBUF,&size,sizeof(size)); // capped by rmem_max.
+  return s;
+ }
+ err=errno; ::close(s); errno=err; return ssError;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Serves Modbus/UDP on ip/port as well (see 'connect_UDP'), with nWorkers
+//! workers sharing the mapping. To be called once connected (TCP) and
+//! before '::execute'.
+void cMODBUSServer::attach_UDP(std::string ip, int port, unsigned nWorkers){
+ if (!isEnabled() || FOwner || FBackEnd==mbRTU) throw Exception("Invalid Operation",
+  cTypeID(THIS,__FUNCTION__),"Not a connected TCP server");
+ for (unsigned w=0; w<cMax(nWorkers,1u); w++){ // (SO_REUSEPORT) workers ......
+  try { newWorker()->connect_UDP(ip,port); }
+  catch (...){ delete FWorkers.back(); FWorkers.pop_back(); throw; }
+ }
+}
+
 /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 //! Create a context for TCP Protocol Independent; ....
 void cMODBUSServer::connect_TCP_PI
@@ -166,14 +1279,13 @@ void cMODBUSServer::connect_TCP_PI
  try { close(); // reset and create new context ...............................
   if (!(FContext=modbus_new_tcp_pi(node.c_str(),service.c_str()))) throw Exception
    ("Fail to create context",cTypeID(THIS,__FUNCTION__),"modbus_new_tcp_pi");
-  if (!(FQuery=static_cast<uint8_t*>(malloc(MODBUS_TCP_MAX_ADU_LENGTH)))) throw
-   Exception("Fail to allocate memory",cTypeID(THIS,__FUNCTION__),"malloc");
   FHeaderLength=modbus_get_header_length(FContext);
   //...........................................................................
   config(); // user configuration, registers definition, etc
 
   /// ... equivalent to modbus_tcp_listen .... see pages above
-
+  capture();
+  FBackEnd=mbTCP_PI; FStopped=false;
  } catch (...){ close(); throw; }
 }
 
@@ -181,18 +1293,25 @@ void cMODBUSServer::connect_TCP_PI
 //! Create a libmodbus context for RTU; ....
 void cMODBUSServer::connect_RTU(int serverID, std::string device,
 int baud, char parity, int dataBits, int stopBit){
+int flags; // tmp.
  try { close(); // reset and create new context ...............................
   if (!(FContext=modbus_new_rtu(device.c_str(),baud,parity,dataBits,stopBit))) throw
    Exception("Fail to create context",cTypeID(THIS,__FUNCTION__),"modbus_new_rtu");
   if (modbus_set_slave(FContext,FRTUServerID=serverID)!=0) throw Exception
    ("Fail to set slave",cTypeID(THIS,__FUNCTION__),"modbus_set_slave");
-  if (!(FQuery=static_cast<uint8_t*>(malloc(MODBUS_RTU_MAX_ADU_LENGTH)))) throw
-   Exception("Fail to allocate memory",cTypeID(THIS,__FUNCTION__),"malloc");
   FHeaderLength=modbus_get_header_length(FContext);
   config(); // user configuration, registers definition, etc
 
-  /// ... equivalent to modbus_tcp_listen .... see pages above
-
+  if (modbus_connect(FContext)==-1) throw Exception // open the serial line ...
+   (modbus_strerror(errno),cTypeID(THIS,__FUNCTION__),"modbus_connect");
+  FSocket=modbus_get_socket(FContext); FBackEnd=mbRTU; // see '::close'
+  if ((flags=fcntl(FSocket,F_GETFL))==-1 || fcntl(FSocket,F_SETFL,flags|O_NONBLOCK)==-1)
+   throw Exception("invalid operation",cTypeID(THIS,__FUNCTION__),"fcntl");
+  // 3.5 chars of 11 bits; fixed to 1.75 ms above 19200 bauds (MODBUS over
+  // serial line specification, 2.5.1.1) .......................................
+  FRTUGap=baud>19200?1750000L:static_cast<long>(38500000000LL/cMax(baud,1));
+  capture(); // the context no longer refers to the line (see '::close').
+  FStopped=false;
  } catch (...){ close(); throw; }
 }
 
@@ -201,6 +1320,179 @@ int baud, char parity, int dataBits, int stopBit){
 void cMODBUSServer::disconnect(){
  FStopped=true; // see loops within '::OnExecute'
  if (FSelfPipe[1]!=ssUndefined) ::write(FSelfPipe[1],"\0",1);
+ for (cMODBUSServer *w: FWorkers) w->disconnect(); // (e.g. drained owner)
+}
+
+/*===========================================================================*/
+//! Duplicates of the listening sockets of the server and its workers, owned
+//! by the caller: to be handed over to the new process (see '::inherit').
+std::vector<int> cMODBUSServer::listeners(){
+std::vector<int> fds; int fd;
+ if (FSocket!=ssUndefined && FBackEnd!=mbRTU &&
+  (fd=fcntl(FSocket,F_DUPFD_CLOEXEC,0))!=-1) fds.push_back(fd);
+ for (cMODBUSServer *w: FWorkers){ std::vector<int> l=w->listeners();
+  fds.insert(fds.end(),l.begin(),l.end()); }
+ return fds;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Once its listening sockets are handed over ('listeners'): the server and
+//! its workers stop accepting and, if 'connections', give away their idle
+//! connections, whose sockets are returned (owned by the caller, to be given
+//! to '::adopt' in the new process). The other connections are served until
+//! closed (or '::disconnect'); once the drain is committed ('::commitDrain')
+//! the server then stops by itself. Until then, the drain can be canceled
+//! ('::cancelDrain'). RTU is not handed over. Blocks until each loop took it
+//! into account (or 'timeout').
+std::vector<int> cMODBUSServer::drain(bool connections){
+std::vector<int> fds; timespec end; int none=drNone;
+ for (cMODBUSServer *w: FWorkers){ std::vector<int> h=w->drain(connections);
+  fds.insert(fds.end(),h.begin(),h.end()); }
+ lock(); //#####################################################################
+ if (FDrain.compare_exchange_strong(none,connections?drHandover:drAccept) &&
+  FSelfPipe[1]!=ssUndefined && ::write(FSelfPipe[1],"\0",1)==1){
+  clock_gettime(CLOCK_REALTIME,&end); end.tv_sec+=FTimeOut;
+  waitForSignal(FDrained,end); // see '::awake'
+ }
+ fds.insert(fds.end(),FHanded.begin(),FHanded.end()); FHanded.clear();
+ unlock(); //###################################################################
+ return fds;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! The handoff completed: the listening sockets of the server and of its
+//! workers are closed and each loop ends once its connections are closed.
+void cMODBUSServer::commitDrain(){
+int handed=drHanded;
+ for (cMODBUSServer *w: FWorkers) w->commitDrain();
+ lock(); //#####################################################################
+ if (FDrain.compare_exchange_strong(handed,drDraining) && FSelfPipe[1]!=ssUndefined)
+  ::write(FSelfPipe[1],"\0",1); // the loop may end now.
+ unlock(); //###################################################################
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! The handoff failed: the server and its workers accept again and serve
+//! 'connections' (those returned by '::drain', then owned by the server) as
+//! if just accepted. Blocks until each loop took it into account (or
+//! 'timeout').
+void cMODBUSServer::cancelDrain(const std::vector<int> &connections){
+timespec end; int handed=drHanded, accept=drAccept, handover=drHandover;
+ for (cMODBUSServer *w: FWorkers) w->cancelDrain(std::vector<int>());
+ lock(); //#####################################################################
+ FAdopted.insert(FAdopted.end(),connections.begin(),connections.end());
+ if (FDrain.compare_exchange_strong(handed,drResume) &&
+  FSelfPipe[1]!=ssUndefined && ::write(FSelfPipe[1],"\0",1)==1){
+  clock_gettime(CLOCK_REALTIME,&end); end.tv_sec+=FTimeOut;
+  waitForSignal(FDrained,end); // see '::awake'
+ } else if (!FDrain.compare_exchange_strong(accept,drNone)) // not seen yet.
+  FDrain.compare_exchange_strong(handover,drNone);
+ unlock(); //###################################################################
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Serves 'socket', a connection handed over by the previous process (see
+//! '::drain'), as soon as executed. To be called once connected and before
+//! '::execute'.
+void cMODBUSServer::adopt(int socket){ FAdopted.push_back(socket); }
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Appends the size and the 'n' entries of 'table' to 'image'.
+template<class T> static void cAppendTable(std::string &image, const T *table, int n){
+uint32_t size=n>0?n:0;
+ image.append(reinterpret_cast<const char*>(&size),sizeof(size));
+ if (size) image.append(reinterpret_cast<const char*>(table),size*sizeof(T));
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Copies the table at 'at' of 'image' into 'table' ('n' entries) as far as
+//! both go. Returns the position of the next table (image size if corrupt).
+template<class T> static size_t cCopyTable(const std::string &image, size_t at, T *table, int n){
+uint32_t size;
+ if (at+sizeof(size)>image.size()) return image.size();
+ memcpy(&size,image.data()+at,sizeof(size)); at+=sizeof(size);
+ if (at+static_cast<size_t>(size)*sizeof(T)>image.size()) return image.size();
+ if (n>0) memcpy(table,image.data()+at,cMin<size_t>(size,n)*sizeof(T));
+ return at+static_cast<size_t>(size)*sizeof(T);
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Consistent copy of the register map (coils, discrete inputs, holding and
+//! input registers), e.g. to be handed over (see 'setMappingImage').
+std::string cMODBUSServer::mappingImage(){
+std::string image; unsigned seq;
+ if (!mb_mapping) return image;
+ do { seq=mappingLock().readBegin(); image.clear(); // seqlock read ...........
+  cAppendTable(image,mb_mapping->tab_bits,mb_mapping->nb_bits);
+  cAppendTable(image,mb_mapping->tab_input_bits,mb_mapping->nb_input_bits);
+  cAppendTable(image,mb_mapping->tab_registers,mb_mapping->nb_registers);
+  cAppendTable(image,mb_mapping->tab_input_registers,mb_mapping->nb_input_registers);
+ } while (mappingLock().readRetry(seq));
+ return image;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Restores a 'mappingImage' (once connected). Tables may have been resized
+//! since (new configuration): only their common range is restored.
+void cMODBUSServer::setMappingImage(const std::string &image){
+size_t at;
+ if (!mb_mapping) return;
+ mappingLock().writeLock(); //#################################################
+ at=cCopyTable(image,0,mb_mapping->tab_bits,mb_mapping->nb_bits);
+ at=cCopyTable(image,at,mb_mapping->tab_input_bits,mb_mapping->nb_input_bits);
+ at=cCopyTable(image,at,mb_mapping->tab_registers,mb_mapping->nb_registers);
+ cCopyTable(image,at,mb_mapping->tab_input_registers,mb_mapping->nb_input_registers);
+ mappingLock().writeUnlock(); //###############################################
+}
+
+/*===========================================================================*/
+//! Listening sockets handed over by the previous process (see 'listeners'):
+//! 'connect_*' (any server of the process) take the one bound to the same
+//! address, if any, instead of binding a new one. Those left are closed by
+//! 'releaseInherited', once every server is connected.
+void cMODBUSServer::inherit(const std::vector<int> &sockets){
+ FInheritedLock.lock();
+ FInherited.insert(FInherited.end(),sockets.begin(),sockets.end());
+ FInheritedLock.unlock();
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+void cMODBUSServer::releaseInherited(){
+ FInheritedLock.lock();
+ for (int fd: FInherited) ::close(fd);
+ FInherited.clear();
+ FInheritedLock.unlock();
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Merges into 'total' the statistics of every worker (owner's call).
+void cMODBUSServer::statistics(cMODBUSStats &total){
+ total.merge(FStats);
+ for (cMODBUSServer *w: FWorkers) total.merge(w->FStats);
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+bool cMODBUSServer::inheriting(){ bool any;
+ FInheritedLock.lock(); any=!FInherited.empty(); FInheritedLock.unlock();
+ return any;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Takes out of the inherited sockets the one of 'type' bound to 'addr', if
+//! any (ssUndefined otherwise).
+int cMODBUSServer::inherited(int type, const sockaddr *addr, socklen_t length){
+sockaddr_storage bound; socklen_t n, tl; int t, fd=ssUndefined;
+ FInheritedLock.lock();
+ for (auto s=FInherited.begin(); s!=FInherited.end(); s++){
+  n=sizeof(bound); tl=sizeof(t); memset(&bound,0,sizeof(bound));
+  if (getsockopt(*s,SOL_SOCKET,SO_TYPE,&t,&tl)==-1 || t!=type) continue;
+  if (getsockname(*s,reinterpret_cast<sockaddr*>(&bound),&n)==-1) continue;
+  // (a pathname AF_UNIX address is reported with its terminating null) ...
+  if (n!=length && !(addr->sa_family==AF_UNIX && n==length+1)) continue;
+  if (memcmp(&bound,addr,length)==0){ fd=*s; FInherited.erase(s); break; }
+ }
+ FInheritedLock.unlock();
+ return fd;
 }
 
 std::string cMODBUSServer::getLocalIP(std::string address){
@@ -9,10 +9,18 @@
 #include <thread_.h>
 #include <math_.h>
 #include <buffer_.h>
+#include <memory_.h>
+#include <time_.h>
+#include <uring_.h>
 
 #include <modbus.h>
+#include <vector>
+#include <memory>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 
 //#include <server_wrapper.h>
 
@@ -24,7 +32,7 @@ namespace CUTIL {
 /*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
 /*                              cModBusServer                                */
 /*! \author Francisco Neves                                                  */
-/*! \date 2018.03.15 ( Last modified 2019.11.13 )                            */
+/*! \date 2018.03.15 ( Last modified 2026.10.17 )                            */
 /*! \brief libModBus Server wrapper                                          */
 /*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
 //! /details
@@ -34,60 +42,272 @@ namespace CUTIL {
 //! ** add to '/etc/ld.so.conf.d' a .conf file (e.g modbus.conf) containing
 //!    the line '/usr/local/libmodbus-3.1.4/lib'
 //! ** may need to uninstall the system version
+//! ** 'connect_UNIX' serves MBAP clients of an AF_UNIX stream socket with the
+//!    same event loops as TCP (no TCP/IP stack for co-located clients);
+//!    'attach_UNIX' adds such a listener to a TCP server (one more worker).
+//! ** 'connect_UDP' serves Modbus/UDP (one MBAP frame per datagram) with its
+//!    own loop ('::executeUDP'): datagrams are received and answered by
+//!    batches ('recvmmsg'/'sendmmsg'), there is no connection state at all.
+//!    'attach_UDP' adds it to a TCP server (workers sharing the mapping).
+//! ** Zero-downtime restart (handoff): the old process gives its listening
+//!    sockets ('listeners'), the idle connections ('drain') and a copy of
+//!    the register map ('mappingImage') to the new one, e.g. over AF_UNIX
+//!    with SCM_RIGHTS ('cSendFds'). The new process hands the listening
+//!    sockets to 'inherit' before 'connect_*' (which then reuse the ones
+//!    bound to the same address instead of binding new ones) and the
+//!    connections to 'adopt' before '::execute'. Meanwhile, pending clients
+//!    just wait in the (shared) accept queue: nothing is refused or reset.
+//!    The old process closes its listening sockets only once everything is
+//!    sent ('commitDrain'); if the handoff fails, it accepts again and serves
+//!    the connections given away ('cancelDrain').
+//! ** 'connect_RTU' serves the serial line with its own loop ('::executeRTU'):
+//!    non-blocking reads, frames ended by a 3.5 chars silence detected with a
+//!    timerfd, FC1-4 replies encoded natively (CRC included).
+//! ** The event loop (see '::OnExecute') is selected at construction:
+//!    'mrSelect' (default) is limited to FD_SETSIZE descriptors and scans all
+//!    of them on each wakeup; 'mrEpoll' is an edge-triggered epoll reactor
+//!    with O(1) cost per event and no descriptor limit (Linux only);
+//!    'mrUring' is a completion based io_uring reactor (Linux 5.19+, see
+//!    '::executeUring') that falls back to 'mrEpoll' if not available.
+//! ** 'connect_TCP' with nWorkers>1 opens nWorkers listening sockets on the
+//!    same address with SO_REUSEPORT, each served by its own thread, context
+//!    and query buffer ('FWorkers', the server itself being the 1st worker).
+//!    SO_REUSEPORT is set even for a single socket, so that it can be joined
+//!    by more workers once handed over.
+//!    The kernel spreads connections among them; all workers share the
+//!    owner's mapping and forward '::OnRequest' to the owner.
+//! ** The mapping is published through a seqlock ('mappingLock'): reads
+//!    (FC1-4) copy the requested range into per-worker snapshot tables and
+//!    never block; any other request, and every user update of the tables,
+//!    must be done between 'mappingLock().writeLock()/writeUnlock()' so that
+//!    multi-register values are never seen torn by the clients.
+//! ** For the TCP backends, each socket is drained into the connection ring
+//!    buffer and every complete MBAP frame in it is served ('::serve'), so
+//!    pipelined requests cost one read and one send. FC1-4 replies are
+//!    encoded natively ('readPDU') straight from the mapping into the
+//!    connection reply buffer (no heap allocation, no libmodbus round trip),
+//!    as are FC22/FC23 ('writePDU', applied in one critical section);
+//!    any other function code falls back to 'modbus_reply', whose reply is
+//!    captured through a socketpair ('FCapture') and coalesced with the
+//!    native ones, so replies are always sent by the reactor itself.
+//! ** Invalid requests (unknown function code, bad quantity, byte count or
+//!    length, address out of the tables) are answered up front with the
+//!    exception reply ('::exception'): neither '::OnRequest', the mapping
+//!    nor any lock are involved, so they cost misbehaving clients only.
+//! ** Each connection owns its buffers, partial frame and counters (see
+//!    'cMODBUSConnection') and is taken from a per-worker pool; the only
+//!    per-worker state used while serving a request is the context bound to
+//!    'FCapture' and the snapshot tables, so requests are served by all the
+//!    workers concurrently and a partial frame only waits on its own socket.
+//!    Replies are never waited for either: those a client does not read are
+//!    kept in its reply buffer and sent once its socket is writable; its
+//!    requests are not served meanwhile (see '::flush').
+//! ** Connections without any I/O for 'idleTimeout' seconds (abandoned or
+//!    half-open) are closed by a per-worker timer wheel ('FWheel'); beyond
+//!    'maxConnections' clients (all workers), new ones are reset as soon as
+//!    accepted (see '::admit'). Both are disabled by default (0).
 
 /*===========================================================================*/
-enum cMODBUSBackend { mbTCP, mbTCP_PI, mbRTU, mbUndefined };
+enum cMODBUSBackend { mbTCP, mbTCP_PI, mbRTU, mbUNIX, mbUDP, mbUndefined };
+enum cMODBUSReactor { mrSelect, mrEpoll, mrUring };
+
+/*===========================================================================*/
+//! Per-connection state of the TCP backends (see 'cMODBUSServer::serve'):
+//! ring buffer of received bytes, where frames are parsed in place, and the
+//! replies coalesced until they are sent at once ('cMODBUSServer::flush').
+//! 'txSent' and 'writing' are the pending send of the readiness reactors
+//! (select, epoll), which never wait: tx[txSent,txLength[ is sent once the
+//! socket is writable. 'txSending', 'nPending', 'blocked' and 'closing' are
+//! only used by the io_uring reactor (see 'cMODBUSServer::executeUring'). A
+//! frame wrapping around the ring is copied to 'query' to be parsed.
+struct cMODBUSConnection {
+    enum cSizes { szRx=2048, szTx=2048 }; // szRx must be a power of 2.
+    int socket;
+    unsigned head, tail; // free-running counters, [tail,head[ is unread.
+    unsigned txLength, txSent; // tx[txSent,txLength[ is not sent yet.
+    unsigned txSending, nPending; // tx[0,txSending[ in flight; pending ops.
+    bool writing; // waits for the socket to be writable (see '::writable').
+    bool blocked, closing;
+    uint64_t nRequests, rxBytes, txBytes; // counters.
+    uint64_t lastActivity; // ms (see 'cMilliseconds').
+    cTimerWheel::cNode timer; // idle timeout.
+    uint8_t rx[szRx], tx[szTx], query[MODBUS_TCP_MAX_ADU_LENGTH];
+    explicit cMODBUSConnection(int socket_):socket(socket_),head(0),tail(0),
+    txLength(0),txSent(0),txSending(0),nPending(0),writing(false),blocked(false),closing(false),
+    nRequests(0),rxBytes(0),txBytes(0),lastActivity(0),timer(this){ }
+    inline unsigned available(){ return head-tail; }
+    inline unsigned pending(){ return txLength-txSent; } // left to send.
+    inline uint8_t at(unsigned i){ return rx[(tail+i)&(szRx-1)]; }
+};
+
+/*===========================================================================*/
+//! Statistics of a worker, recorded by its thread only and merged on demand
+//! (see 'cMODBUSServer::statistics'). Latencies (ns) are split by function
+//! code ('::slot') and stage: dispatch ('OnRequest') and reply (decoding,
+//! mapping access, encoding). 'receive' is the time spent in each socket
+//! read returning data (not measured by the io_uring reactor). 'errors'
+//! counts malformed frames and failed sends; 'exceptions' the exception
+//! replies.
+struct cMODBUSStats {
+    enum cStage { stDispatch, stReply, nStages };
+    enum { nSlots=11 }; // FC1-6, 15, 16, 22, 23 and others.
+    cHistogram receive, latency[nSlots][nStages];
+    std::atomic<uint64_t> requests, rxBytes, txBytes, errors, exceptions;
+    explicit cMODBUSStats():requests(0),rxBytes(0),txBytes(0),errors(0),exceptions(0){ }
+    static inline void add(std::atomic<uint64_t> &a, uint64_t n){ // single writer
+     a.store(a.load(std::memory_order_relaxed)+n,std::memory_order_relaxed); }
+    static unsigned slot(uint8_t function);
+    static const char* name(unsigned slot);
+    void merge(const cMODBUSStats &s);
+    std::vector<std::string> report() const;
+};
 
 /*===========================================================================*/
 class cMODBUSServer: public cThread {
 protected: enum cSocketStatus { ssError=-1, ssUndefined=-1 };
 private: //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
-    int FSocket;
+    int FSocket, FEpoll;
+    fd_set *FReadSet, FWriteSet; // 'select' sets (see '::writable').
     int FSelfPipe[2];
+    int FCapture[2]; // 'modbus_reply' writes to [0], replies are read from [1].
+    int FTimer; // RTU frame gap timerfd.
+    cURing *FURing;
     modbus_t *FContext;
     cMODBUSBackend FBackEnd;
+    cMODBUSReactor FReactor;
     int FRTUServerID, FHeaderLength, FnConnections;
+    long FRTUGap; // ns, 3.5 chars silence ending a RTU frame.
     unsigned FTimeOut;
-    uint8_t *FQuery;
     bool FStopped;
     modbus_mapping_t* mb_mapping;
     CMATH::cBuffer<unsigned> FStatus, FTmp;
+    cMODBUSServer *FOwner; // nullptr unless a worker (see 'FWorkers').
+    std::vector<cMODBUSServer*> FWorkers;
+    cSeqLock FMappingLock; // owner's one is used (see 'mappingLock').
+    uint8_t FSnapBits[MODBUS_MAX_READ_BITS];
+    uint16_t FSnapRegisters[MODBUS_MAX_READ_REGISTERS];
+    std::vector<cMODBUSConnection*> FConnections; // indexed by socket.
+    CMATH::cPool<cMODBUSConnection> FConnectionPool;
+    cTimerWheel FWheel; // idle timeouts.
+    __kernel_timespec FTick; // 'FWheel' tick (io_uring timeout).
+    uint64_t FNow; // ms, updated on each wakeup.
+    unsigned FIdleTimeOut, FMaxConnections;
+    std::atomic<unsigned> FnClients; // owner's one is used (see 'clients').
+    enum cDrain { drNone, drAccept, drHandover, drHanded, drResume, drDraining };
+    std::atomic<int> FDrain; // see '::drain'.
+    cMODBUSStats FStats; // this worker's (see '::statistics').
+    cConditionalWaiting FDrained;
+    std::vector<int> FHanded, FAdopted; // connections given/taken (handoff).
+    static std::vector<int> FInherited; // listening sockets (see '::inherit').
+    static cMutex FInheritedLock;
 
     int max_register = 0;
     int max_coil = 0;
     int max_input = 0;
     int max_discrete = 0;
+    //.........................................................................
+    void selfPipe();
+    void executeSelect();
+    void executeEpoll();
+    void acceptEpoll();
+    void receiveEpoll(int socket);
+    void executeRTU();
+    void serveRTU(cMODBUSConnection &c);
+    void executeUDP();
+    void executeUring();
+    void acceptUring();
+    void wakeUring();
+    void receiveUring(cMODBUSConnection &c);
+    void sendUring(cMODBUSConnection &c);
+    void closeUring(cMODBUSConnection &c);
+    void tickUring();
+    void receivedUring(cMODBUSConnection &c, int res, unsigned flags);
+    void sentUring(cMODBUSConnection &c, int res);
+    void open_connection(int socket);
+    void close_connection(int socket);
+    bool admit(int socket);
+    void reject(int socket);
+    void expire(fd_set *refset=nullptr);
+    bool awake(fd_set *refset=nullptr, int *fdmax=nullptr);
+    void adopted(fd_set *refset=nullptr, int *fdmax=nullptr);
+    bool drained();
+    static int inherited(int type, const sockaddr *addr, socklen_t length);
+    static bool inheriting();
+    inline std::atomic<unsigned>& clients(){ return FOwner?FOwner->FnClients:FnClients; }
+    bool serve(cMODBUSConnection &c);
+    int frames(cMODBUSConnection &c);
+    bool flush(cMODBUSConnection &c);
+    void writable(cMODBUSConnection &c, bool on);
+    std::string FUnixPath; // see '::close'
+    int listen_TCP(std::string ip, int port, int nConnect);
+    int listen_UNIX(std::string path, int nConnect);
+    int listen_UDP(std::string ip, int port);
+    cMODBUSServer* newWorker();
+    void capture();
+    bool snapshot(const uint8_t *req, modbus_mapping_t &snap);
+    unsigned readPDU(const uint8_t *req, uint8_t *rsp);
+    unsigned writePDU(const uint8_t *req, unsigned length, uint8_t *rsp);
+    int exception(const uint8_t *req, unsigned length, uint8_t *rsp);
+    unsigned request(const uint8_t *req, unsigned length, uint8_t *rsp, unsigned size);
+    explicit cMODBUSServer(cMODBUSServer *owner_, unsigned timeout_, cMODBUSReactor reactor_);
 protected: //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
-    inline const uint8_t* query(){ return FQuery; }
-    
     inline int headerLength(){ return FHeaderLength; }
     inline int nConnections(){ return FnConnections; }
     inline bool stopped(){ return FStopped; }
+    inline const cMODBUSConnection* connection(int socket){
+     return static_cast<size_t>(socket)<FConnections.size()?FConnections[socket]:nullptr; }
     //.........................................................................
     virtual void config();
     virtual void selfPipeTrick(int &fdmax, fd_set &refset);
+    virtual void selfPipeTrick(int epfd);
+    virtual void selfPipeTrick(cURing &ring);
     virtual void start_connection(sockaddr_in &/*clientaddr*/, int /*socket*/){ }
-    void reply(unsigned req_length);
+    void reply(cMODBUSConnection &c, const uint8_t *req, unsigned req_length);
+    unsigned reply(const uint8_t *req, unsigned req_length, uint8_t *rsp, unsigned size);
     virtual void end_connection(int /*socket*/){ }
     virtual void close();
     //.........................................................................
     virtual void OnStart();
     virtual void OnExecute();
-    virtual void OnStop(){ close(); }
-    virtual void OnRequest(unsigned req_length);
+    virtual void OnStop();
+    virtual void OnRequest(const uint8_t *req, unsigned req_length);
+    virtual void OnMaskWrite(int address, uint16_t value);
 public: //:::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
-    explicit cMODBUSServer(unsigned timeout_=10);
+    explicit cMODBUSServer(unsigned timeout_=10, cMODBUSReactor reactor_=mrSelect);
     virtual ~cMODBUSServer(){ close(); }
     //.........................................................................
-    void connect_TCP(std::string ip, int port, int nConnect=1);
+    void connect_TCP(std::string ip, int port, int nConnect=1, unsigned nWorkers=1);
     void connect_TCP_PI(std::string node, std::string service, int nConnect=1);
     void connect_RTU(int ID, std::string dev, int b, char p, int dBits, int sBit);
+    void connect_UNIX(std::string path, int nConnect=1);
+    void attach_UNIX(std::string path, int nConnect=1);
+    void connect_UDP(std::string ip, int port, unsigned nWorkers=1);
+    void attach_UDP(std::string ip, int port, unsigned nWorkers=1);
     void disconnect();
+    //.........................................................................
+    std::vector<int> listeners();
+    std::vector<int> drain(bool connections=true);
+    void commitDrain();
+    void cancelDrain(const std::vector<int> &connections);
+    void adopt(int socket);
+    std::string mappingImage();
+    void setMappingImage(const std::string &image);
+    static void inherit(const std::vector<int> &sockets);
+    static void releaseInherited();
+    void statistics(cMODBUSStats &total);
     //void setWServer(WServer *iwserver){ wserver = iwserver;};
     //.........................................................................
     inline cMODBUSBackend backend(){ return FBackEnd; }
+    inline cMODBUSReactor reactor(){ return FReactor; }
+    inline unsigned nWorkers(){ return FWorkers.size()+1; }
     inline bool isEnabled(){ return FBackEnd!=mbUndefined; }
     inline unsigned timeout(){return FTimeOut; }
+    inline unsigned idleTimeout(){ return FIdleTimeOut; }
+    inline unsigned maxConnections(){ return FMaxConnections; }
+    inline unsigned nClients(){ return clients().load(std::memory_order_relaxed); }
+    //! To be set before 'connect_*' (workers copy them).
+    void setIdleTimeout(unsigned seconds){ FIdleTimeOut=seconds; }
+    void setMaxConnections(unsigned n){ FMaxConnections=n; }
     void setMaxRegister(int value) { max_register = value; }
     void setMaxCoil(int value)     { max_coil = value; }
     void setMaxInput(int value)    { max_input = value; }
@@ -99,6 +319,7 @@ public: //:::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
     int getMaxDiscrete() const { return max_discrete; }
     
     modbus_mapping_t* getMapping(){return mb_mapping;};
+    inline cSeqLock& mappingLock(){ return FOwner?FOwner->FMappingLock:FMappingLock; }
     std::string getLocalIP(std::string address);
     inline modbus_t* context(){ return FContext; }
 
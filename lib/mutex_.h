@@ -10,6 +10,8 @@
 #endif
 
 #include "pthread.h"
+#include <atomic>
+#include <utility> // std::move
 
 #include "exception_.h"
 
@@ -192,6 +194,90 @@ public: //:::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
     void waitForN();
 };
 
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+/*                                 cSeqLock                                  */
+/*! \author Francisco Neves                                                  */
+/*! \date 2026.10.17 ( Last modified 2026.10.17 )                            */
+/*! \brief Sequence lock: lock-free readers, serialised writers              */
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+//! \details
+//! ** Writers are serialised by the inherited mutex and bump the sequence to
+//!   an odd value while writing ('::writeLock') and back to even when done
+//!   ('::writeUnlock').
+//! ** Readers never block: they copy the protected data and retry if a write
+//!   overlapped the copy, e.g:
+//!   do { s=lock.readBegin(); memcpy(dst,src,n); } while (lock.readRetry(s));
+//! ** Only plain copies are allowed between '::readBegin' and '::readRetry'
+//!   (the copied data may be inconsistent until '::readRetry' returns false).
+class cSeqLock: protected cMutex {
+private: //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+    std::atomic<unsigned> FSeq;
+    cSeqLock(cSeqLock&):cMutex(){ } //> disable.
+public: //:::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+    explicit cSeqLock():cMutex(),FSeq(0){ }
+    virtual ~cSeqLock(){ }
+    //.........................................................................
+    inline void writeLock(){ cMutex::lock();
+     FSeq.store(FSeq.load(std::memory_order_relaxed)+1,std::memory_order_relaxed);
+     std::atomic_thread_fence(std::memory_order_release); }
+    inline void writeUnlock(){
+     FSeq.store(FSeq.load(std::memory_order_relaxed)+1,std::memory_order_release);
+     cMutex::unlock(); }
+    //.........................................................................
+    inline unsigned readBegin() const { return FSeq.load(std::memory_order_acquire); }
+    inline bool readRetry(unsigned seq) const {
+     std::atomic_thread_fence(std::memory_order_acquire);
+     return (seq&1) || FSeq.load(std::memory_order_relaxed)!=seq; }
+};
+
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+/*                                cMPSCQueue                                 */
+/*! \author Francisco Neves                                                  */
+/*! \date 2026.10.17 ( Last modified 2026.10.17 )                            */
+/*! \brief Lock-free multiple producers, single consumer bounded queue       */
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+//! \details
+//! ** Ring of slots preallocated at construction (capacity rounded up to a
+//!   power of 2): '::push' (any thread) claims a slot with one compare and
+//!   swap and never allocates, '::pop' must always be called by the same
+//!   (consumer) thread.
+//! ** Each slot has a sequence number telling whether it is free for the
+//!   push of position 'n' (n), filled by it (n+1) or still to be popped from
+//!   the previous lap, so producers and consumer never share a slot.
+//! ** Full queue: '::push' returns false and drops 'data' (the caller decides
+//!   how to account for it).
+//! ** An element being pushed is only seen by '::pop' once its producer
+//!   filled the slot (there is a short window where '::pop' returns false
+//!   while a push is in progress): pair the queue with a wakeup of the
+//!   consumer issued after '::push' returns.
+template <class T> class cMPSCQueue {
+private: //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+    struct cSlot { std::atomic<unsigned> FSeq; T FData; };
+    cSlot *FSlots;
+    unsigned FMask;
+    std::atomic<unsigned> FHead; // next position to push.
+    unsigned FTail; // next position to pop (consumer).
+    cMPSCQueue(cMPSCQueue&){ } //> disable.
+public: //:::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+    explicit cMPSCQueue(unsigned capacity):FHead(0),FTail(0){
+     for (FMask=1; FMask<capacity; FMask<<=1);
+     FSlots=new cSlot[FMask--];
+     for (unsigned i=0; i<=FMask; i++) FSlots[i].FSeq.store(i,std::memory_order_relaxed); }
+    virtual ~cMPSCQueue(){ delete[] FSlots; }
+    //.........................................................................
+    inline unsigned capacity() const { return FMask+1; }
+    bool push(T data){ cSlot *slot; unsigned pos=FHead.load(std::memory_order_relaxed); int dif;
+     for (;;){ slot=&FSlots[pos&FMask];
+      dif=static_cast<int>(slot->FSeq.load(std::memory_order_acquire)-pos);
+      if (dif==0){ if (FHead.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed)) break; }
+      else if (dif<0) return false; // full: not popped since the previous lap.
+      else pos=FHead.load(std::memory_order_relaxed); }
+     slot->FData=std::move(data); slot->FSeq.store(pos+1,std::memory_order_release); return true; }
+    bool pop(T &data){ cSlot *slot=&FSlots[FTail&FMask];
+     if (slot->FSeq.load(std::memory_order_acquire)!=FTail+1) return false;
+     data=std::move(slot->FData); slot->FSeq.store(FTail+FMask+1,std::memory_order_release);
+     FTail++; return true; }
+};
 }
 
 #endif // _MUTEX_ #############################################################
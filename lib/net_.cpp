@@ -9,6 +9,7 @@
 #include <linux/wireless.h>
 #include <ifaddrs.h>
 #include <netdb.h>
+#include <errno.h>
 
 
 #define ADDRSIZE 128
@@ -99,5 +100,44 @@ struct addrinfo hints, *res;
  return addrstr;
 }
 
+/*===========================================================================*/
+//! Sends 'data' (at least 1 byte) along with 'nFds' file descriptors (at most
+//! SCM_MAX_FD, 253) over the AF_UNIX 'socket' (SCM_RIGHTS): the receiver gets
+//! its own descriptors of the same open files. Returns false on error.
+bool cSendFds(int socket, const void *data, size_t length, const int *fds, unsigned nFds){
+msghdr msg; iovec iov; cmsghdr *cmsg; std::vector<char> control(CMSG_SPACE(nFds*sizeof(int)));
+ memset(&msg,0,sizeof(msg)); iov.iov_base=const_cast<void*>(data); iov.iov_len=length;
+ msg.msg_iov=&iov; msg.msg_iovlen=1;
+ if (nFds){
+  msg.msg_control=control.data(); msg.msg_controllen=control.size();
+  cmsg=CMSG_FIRSTHDR(&msg); cmsg->cmsg_level=SOL_SOCKET; cmsg->cmsg_type=SCM_RIGHTS;
+  cmsg->cmsg_len=CMSG_LEN(nFds*sizeof(int)); memcpy(CMSG_DATA(cmsg),fds,nFds*sizeof(int));
+ }
+ for (; ; ){
+  if (sendmsg(socket,&msg,MSG_NOSIGNAL)==static_cast<ssize_t>(length)) return true;
+  if (errno!=EINTR) return false;
+ }
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Receives a message sent by 'cSendFds' (up to 'length' bytes); the received
+//! descriptors (close-on-exec) are appended to 'fds'. Returns the number of
+//! bytes received (0 if the peer is gone, -1 on error).
+ssize_t cRecvFds(int socket, void *data, size_t length, std::vector<int> &fds){
+msghdr msg; iovec iov; cmsghdr *cmsg; ssize_t n; unsigned nFds;
+std::vector<char> control(CMSG_SPACE(253*sizeof(int))); // SCM_MAX_FD
+ memset(&msg,0,sizeof(msg)); iov.iov_base=data; iov.iov_len=length;
+ msg.msg_iov=&iov; msg.msg_iovlen=1;
+ msg.msg_control=control.data(); msg.msg_controllen=control.size();
+ while ((n=recvmsg(socket,&msg,MSG_CMSG_CLOEXEC))==-1 && errno==EINTR);
+ if (n<=0) return n;
+ for (cmsg=CMSG_FIRSTHDR(&msg); cmsg; cmsg=CMSG_NXTHDR(&msg,cmsg)){
+  if (cmsg->cmsg_level!=SOL_SOCKET || cmsg->cmsg_type!=SCM_RIGHTS) continue;
+  nFds=(cmsg->cmsg_len-CMSG_LEN(0))/sizeof(int);
+  for (unsigned i=0; i<nFds; i++){ int fd;
+   memcpy(&fd,CMSG_DATA(cmsg)+i*sizeof(int),sizeof(int)); fds.push_back(fd); }
+ }
+ return n;
+}
+
 }
- 
@@ -9,6 +9,8 @@
 #include "string_.h"
 
 #include <string>
+#include <vector>
+#include <sys/types.h>
 
 namespace CUTIL {
 
@@ -18,6 +20,9 @@ bool cIsInterfaceWireless(std::string interface, std::string *protocol=nullptr);
 std::string cGetIPAddress(std::string interface);
 std::string cGetHostIpAddress(std::string domainName);
 
+bool cSendFds(int socket, const void *data, size_t length, const int *fds, unsigned nFds);
+ssize_t cRecvFds(int socket, void *data, size_t length, std::vector<int> &fds);
+
 }
 
 #endif // _NET_ ###############################################################
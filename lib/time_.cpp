@@ -9,6 +9,82 @@ using std::chrono::system_clock;
 
 namespace CUTIL{
 
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+/*                                cTimerWheel                                */
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+
+/*===========================================================================*/
+//! 'nSlots' must be a power of 2; 'tick' (ms) is the wheel resolution.
+cTimerWheel::cTimerWheel(unsigned nSlots, unsigned tick):FSlots(nSlots),
+FTick(tick?tick:1),FCurrent(cMilliseconds()/FTick){
+ if (!nSlots || (nSlots&(nSlots-1))) throw CEXCP::Exception("Invalid Argument",
+  CEXCP::cTypeID(THIS,__FUNCTION__),"nSlots must be a power of 2");
+ for (cNode &s: FSlots) s.prev=s.next=&s;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! (Re)schedule 'n' to expire at 'expiry' (ms, see 'cMilliseconds'); a past
+//! expiry is hashed to the current tick (expires on the next '::advance').
+void cTimerWheel::schedule(cNode &n, uint64_t expiry){
+cNode &s=slot(expiry/FTick<FCurrent?FCurrent*FTick:expiry);
+ if (n.scheduled()) cancel(n);
+ n.expiry=expiry; n.prev=&s; n.next=s.next; s.next->prev=&n; s.next=&n;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+void cTimerWheel::cancel(cNode &n){
+ if (!n.scheduled()) return;
+ n.prev->next=n.next; n.next->prev=n.prev; n.prev=n.next=nullptr;
+}
+
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+/*                                cHistogram                                 */
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+
+/*===========================================================================*/
+//! Largest value counted in bucket 'i' (see '::bucket').
+uint64_t cHistogram::bucketMax(unsigned i){ unsigned k;
+ if (i<szSub) return i;
+ k=i/szSub+szBits-1; // bucket range: [(szSub+sub)<<(k-szBits), +2^(k-szBits)[
+ return ((static_cast<uint64_t>(szSub+i%szSub)+1)<<(k-szBits))-1;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Only by the writer (or while nobody records).
+void cHistogram::clear(){
+ for (unsigned i=0; i<szBuckets; i++) FCounts[i].store(0,std::memory_order_relaxed);
+ FCount.store(0,std::memory_order_relaxed); FSum.store(0,std::memory_order_relaxed);
+ FMax.store(0,std::memory_order_relaxed);
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Adds 'h' (recorded by any thread) to this one (written by the caller).
+void cHistogram::merge(const cHistogram &h){ uint64_t n, m;
+ for (unsigned i=0; i<szBuckets; i++)
+  if ((n=h.FCounts[i].load(std::memory_order_relaxed))) add(FCounts[i],n);
+ add(FCount,h.FCount.load(std::memory_order_relaxed));
+ add(FSum,h.FSum.load(std::memory_order_relaxed));
+ if ((m=h.FMax.load(std::memory_order_relaxed))>max()) FMax.store(m,std::memory_order_relaxed);
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+double cHistogram::mean() const { uint64_t n=count();
+ return n?static_cast<double>(FSum.load(std::memory_order_relaxed))/n:0;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Smallest value (bucket upper bound, at most '::max') not exceeded by 'p'
+//! percent of the recorded values, e.g: percentile(99.9). 0 if empty.
+uint64_t cHistogram::percentile(double p) const {
+uint64_t n=count(), target, seen=0, v;
+ if (!n) return 0;
+ target=static_cast<uint64_t>(ceil(p/100*n)); if (target<1) target=1;
+ for (unsigned i=0; i<szBuckets; i++)
+  if ((seen+=FCounts[i].load(std::memory_order_relaxed))>=target){
+   v=bucketMax(i); return v<max()?v:max(); }
+ return max();
+}
+
 /*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
 /*                                cLoopTimer                                 */
 /*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
@@ -131,6 +207,19 @@ timespec cTimeSpec(clockid_t c){
 timespec t; clock_gettime(c,&t); return t;
 }
 
+/*===========================================================================*/
+//! Get current time in ms (CLOCK_MONOTONIC_COARSE is cheap, ~4 ms resolution).
+uint64_t cMilliseconds(clockid_t c){
+timespec t; clock_gettime(c,&t);
+ return static_cast<uint64_t>(t.tv_sec)*1000+t.tv_nsec/1000000;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+uint64_t cNanoseconds(clockid_t c){
+timespec t; clock_gettime(c,&t);
+ return static_cast<uint64_t>(t.tv_sec)*1000000000ULL+t.tv_nsec;
+}
+
 /*===========================================================================*/
 //! Convert 'timespec' to string ("X s Y ns").
 string cString(timespec &val){
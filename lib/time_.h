@@ -9,6 +9,9 @@
 #include <ctime>
 #include <chrono>
 #include <iomanip>
+#include <vector>
+#include <stdint.h>
+#include <atomic>
 
 #include "exception_.h"
 
@@ -20,6 +23,8 @@ namespace CUTIL{
     
 //! ctTime      : Measure time between events.
 //! cLoopTimer  : timed loop iterations
+//! cTimerWheel : hashed timer wheel (e.g. idle timeouts)
+//! cHistogram  : latency histogram (log-linear buckets)
 //! -----------------------------------
 //! cHMSTime(t,H,M,S) : Gets how many hours (H). minutes (M) and seconds (S) t (in sec) is.
 //! cHMSTimeStr(t,f) : Converts t (sec) to string (H hour M min S s).
@@ -27,6 +32,8 @@ namespace CUTIL{
 //! cSeconds(t) : convert 't' (timespec) to seconds (ns resolution)
 //! cTimeSpec(s): Convert 's' (seconds) to timespec
 //! cTimeSpec(c): Get current timespect (c is type of click).
+//! cMilliseconds(c): Get current time in ms (c is type of click).
+//! cNanoseconds(c): Get current time in ns (c is type of click).
 //! cString(t)  : convert 't' (timespec) to string ("X s Y ns").
 //! -----------------------------------
 //! ** Check also string_h for more date related functions
@@ -87,6 +94,99 @@ public: //:::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 
 #endif // CTHREAD_ENABLE ######################################################
 
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+/*                                cTimerWheel                                */
+/*! \author Francisco Neves                                                  */
+/*! \date 2026.10.17 ( Last modified 2026.10.17 )                            */
+/*! \brief Hashed timer wheel (not thread safe)                              */
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+//! \details
+//! ** Timers are intrusive nodes hashed by expiry (ms) into 'nSlots' lists
+//!   of 'tick' ms each: scheduling/cancelling is O(1) and '::advance' only
+//!   visits the slots ticked since the last call (timers of later rounds
+//!   sharing a slot are skipped).
+//! ** Timers with a sliding deadline (e.g. idle timeouts) are cheaper left
+//!   scheduled and checked when they expire, e.g:
+//!   wheel.advance(cMilliseconds(),[&](cTimerWheel::cNode &n){
+//!    if (last+idle>now) wheel.schedule(n,last+idle); else ... });
+class cTimerWheel {
+public: struct cNode { //%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+    cNode *prev, *next; // intrusive list (nullptr if not scheduled).
+    uint64_t expiry;    // ms
+    void *data;         // user data.
+    explicit cNode(void *data_=nullptr):prev(nullptr),next(nullptr),expiry(0),data(data_){ }
+    inline bool scheduled(){ return prev!=nullptr; }
+}; //%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+private: //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+    std::vector<cNode> FSlots; // list heads (circular).
+    unsigned FTick;
+    uint64_t FCurrent; // last tick advanced.
+    cTimerWheel(cTimerWheel&){ } //> disable.
+    inline cNode& slot(uint64_t ms){ return FSlots[(ms/FTick)&(FSlots.size()-1)]; }
+public: //:::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+    explicit cTimerWheel(unsigned nSlots=256, unsigned tick=100);
+    virtual ~cTimerWheel(){ }
+    //.........................................................................
+    void schedule(cNode &n, uint64_t expiry);
+    void cancel(cNode &n);
+    inline unsigned tick(){ return FTick; }
+    //.........................................................................
+    //! Calls 'expired(cNode&)' for every timer expired at 'now' (unscheduled
+    //! before the call, so it may be scheduled again).
+    template <class Expired> void advance(uint64_t now, Expired expired){
+    uint64_t last=now/FTick, t=FCurrent; cNode *n, *next, *head;
+     if (last-t>=FSlots.size()) t=last-FSlots.size()+1; // full turn.
+     for (; t<=last; t++){ head=&FSlots[t&(FSlots.size()-1)];
+      for (n=head->next; n!=head; n=next){ next=n->next;
+       if (n->expiry<=now){ cancel(*n); expired(*n); } } }
+     FCurrent=last;
+    }
+};
+
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+/*                                cHistogram                                 */
+/*! \author Francisco Neves                                                  */
+/*! \date 2026.10.17 ( Last modified 2026.10.17 )                            */
+/*! \brief Latency histogram (log-linear buckets, single writer)             */
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+//! \details
+//! ** HDR-like: values (e.g. ns) are counted in 'szSub' linear buckets per
+//!   power of 2 (relative error below 1/szSub) up to 2^szMaxBits; larger
+//!   values are counted in the last bucket. '::record' is an index
+//!   computation and a few relaxed stores (no lock, no atomic RMW).
+//! ** A single thread records; any thread may read the histogram or merge
+//!   it into another one ('::merge', e.g. a total of per-thread histograms),
+//!   possibly missing the values being recorded meanwhile.
+class cHistogram {
+public: enum cSizes { szBits=4, szSub=1<<szBits, szMaxBits=40,
+    szBuckets=(szMaxBits-szBits+1)*szSub };
+private: //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+    std::atomic<uint64_t> FCounts[szBuckets];
+    std::atomic<uint64_t> FCount, FSum, FMax;
+    cHistogram(cHistogram&){ } //> disable.
+    static inline void add(std::atomic<uint64_t> &a, uint64_t v){ // single writer
+     a.store(a.load(std::memory_order_relaxed)+v,std::memory_order_relaxed); }
+public: //:::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+    explicit cHistogram(){ clear(); }
+    virtual ~cHistogram(){ }
+    //.........................................................................
+    static inline unsigned bucket(uint64_t v){ unsigned k;
+     if (v<szSub) return v;
+     if ((k=63-__builtin_clzll(v))>=szMaxBits) return szBuckets-1; // 2^k<=v
+     return (k-szBits+1)*szSub+((v>>(k-szBits))&(szSub-1)); }
+    static uint64_t bucketMax(unsigned i);
+    inline void record(uint64_t v){
+     add(FCounts[bucket(v)],1); add(FCount,1); add(FSum,v);
+     if (v>FMax.load(std::memory_order_relaxed)) FMax.store(v,std::memory_order_relaxed); }
+    //.........................................................................
+    void clear();
+    void merge(const cHistogram &h);
+    inline uint64_t count() const { return FCount.load(std::memory_order_relaxed); }
+    inline uint64_t max() const { return FMax.load(std::memory_order_relaxed); }
+    double mean() const;
+    uint64_t percentile(double p) const;
+};
+
 /*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
 /*                                 FUNCTION                                  */
 /*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
@@ -97,6 +197,8 @@ std::string cHMSTimeStr(double);
 float cSeconds(const timespec&);
 timespec cTimeSpec(const double s);
 timespec cTimeSpec(clockid_t c=CLOCK_REALTIME);
+uint64_t cMilliseconds(clockid_t c=CLOCK_MONOTONIC_COARSE);
+uint64_t cNanoseconds(clockid_t c=CLOCK_MONOTONIC);
 std::string cString(timespec&);
 
 std::tm cCurrentTime();
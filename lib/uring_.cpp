@@ -0,0 +1,123 @@
+#include "uring_.h"
+
+#include <unistd.h>
+#include <string.h> // memset
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+using namespace CEXCP;
+
+namespace CUTIL {
+
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+/*                                   cURing                                  */
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+
+/*===========================================================================*/
+//! 'nBuffers' must be a power of 2 (<=32768).
+cURing::cURing(unsigned entries, unsigned nBuffers, unsigned bufSize):
+FRing(-1),FSqMap(MAP_FAILED),FCqMap(MAP_FAILED),FSqSize(0),FCqSize(0),
+FSqes(static_cast<io_uring_sqe*>(MAP_FAILED)),FSqesSize(0),FSqLocal(0),
+FBufRing(static_cast<io_uring_buf_ring*>(MAP_FAILED)),FBufRingSize(0),
+FBuffers(static_cast<uint8_t*>(MAP_FAILED)),FnBuffers(nBuffers),FBufSize(bufSize){
+io_uring_params p; io_uring_buf_reg reg; uint8_t *sq, *cq;
+ memset(&p,0,sizeof(p)); p.flags=IORING_SETUP_CLAMP;
+ if ((FRing=syscall(__NR_io_uring_setup,entries,&p))==-1) throw Exception
+  ("Invalid Operation",cTypeID(THIS,__FUNCTION__),"io_uring_setup");
+ try { // map the rings ........................................................
+  FSqSize=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+  FCqSize=p.cq_off.cqes+p.cq_entries*sizeof(io_uring_cqe);
+  if (p.features&IORING_FEAT_SINGLE_MMAP) FSqSize=FCqSize=(FSqSize>FCqSize?FSqSize:FCqSize);
+  if ((FSqMap=mmap(0,FSqSize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+   FRing,IORING_OFF_SQ_RING))==MAP_FAILED) throw Exception
+   ("Invalid Operation",cTypeID(THIS,__FUNCTION__),"mmap(IORING_OFF_SQ_RING)");
+  if (p.features&IORING_FEAT_SINGLE_MMAP) FCqMap=FSqMap;
+  else if ((FCqMap=mmap(0,FCqSize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+   FRing,IORING_OFF_CQ_RING))==MAP_FAILED) throw Exception
+   ("Invalid Operation",cTypeID(THIS,__FUNCTION__),"mmap(IORING_OFF_CQ_RING)");
+  FSqesSize=p.sq_entries*sizeof(io_uring_sqe);
+  if ((FSqes=static_cast<io_uring_sqe*>(mmap(0,FSqesSize,PROT_READ|PROT_WRITE,
+   MAP_SHARED|MAP_POPULATE,FRing,IORING_OFF_SQES)))==MAP_FAILED) throw Exception
+   ("Invalid Operation",cTypeID(THIS,__FUNCTION__),"mmap(IORING_OFF_SQES)");
+  sq=static_cast<uint8_t*>(FSqMap); cq=static_cast<uint8_t*>(FCqMap);
+  FSqHead=reinterpret_cast<unsigned*>(sq+p.sq_off.head);
+  FSqTail=reinterpret_cast<unsigned*>(sq+p.sq_off.tail);
+  FSqMask=reinterpret_cast<unsigned*>(sq+p.sq_off.ring_mask);
+  FSqArray=reinterpret_cast<unsigned*>(sq+p.sq_off.array);
+  FSqEntries=p.sq_entries; FSqLocal=*FSqTail;
+  FCqHead=reinterpret_cast<unsigned*>(cq+p.cq_off.head);
+  FCqTail=reinterpret_cast<unsigned*>(cq+p.cq_off.tail);
+  FCqMask=reinterpret_cast<unsigned*>(cq+p.cq_off.ring_mask);
+  FCqes=reinterpret_cast<io_uring_cqe*>(cq+p.cq_off.cqes);
+  // provided buffers ring (page aligned) and buffers ..........................
+  FBufRingSize=FnBuffers*sizeof(io_uring_buf);
+  if ((FBufRing=static_cast<io_uring_buf_ring*>(mmap(0,FBufRingSize,
+   PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0)))==MAP_FAILED) throw
+   Exception("Fail to allocate memory",cTypeID(THIS,__FUNCTION__),"mmap");
+  if ((FBuffers=static_cast<uint8_t*>(mmap(0,static_cast<size_t>(FnBuffers)*FBufSize,
+   PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0)))==MAP_FAILED) throw
+   Exception("Fail to allocate memory",cTypeID(THIS,__FUNCTION__),"mmap");
+  memset(&reg,0,sizeof(reg)); reg.ring_addr=reinterpret_cast<uint64_t>(FBufRing);
+  reg.ring_entries=FnBuffers; reg.bgid=bgid;
+  if (syscall(__NR_io_uring_register,FRing,IORING_REGISTER_PBUF_RING,&reg,1)==-1)
+   throw Exception("Invalid Operation",cTypeID(THIS,__FUNCTION__),
+   "io_uring_register(IORING_REGISTER_PBUF_RING)");
+  for (unsigned bid=0; bid<FnBuffers; bid++) recycle(bid);
+ } catch (...){ free(); throw; }
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Closing the ring cancels every pending request.
+void cURing::free(){
+ if (FRing!=-1){ ::close(FRing); FRing=-1; }
+ if (FSqes!=MAP_FAILED){ munmap(FSqes,FSqesSize); FSqes=static_cast<io_uring_sqe*>(MAP_FAILED); }
+ if (FCqMap!=MAP_FAILED && FCqMap!=FSqMap) munmap(FCqMap,FCqSize);
+ if (FSqMap!=MAP_FAILED) munmap(FSqMap,FSqSize);
+ FSqMap=FCqMap=MAP_FAILED;
+ if (FBufRing!=MAP_FAILED){ munmap(FBufRing,FBufRingSize);
+  FBufRing=static_cast<io_uring_buf_ring*>(MAP_FAILED); }
+ if (FBuffers!=MAP_FAILED){ munmap(FBuffers,static_cast<size_t>(FnBuffers)*FBufSize);
+  FBuffers=static_cast<uint8_t*>(MAP_FAILED); }
+}
+
+/*===========================================================================*/
+//! Next free (zeroed) submission entry; queued ones are submitted if the
+//! submission ring is full.
+io_uring_sqe* cURing::get(){ io_uring_sqe *sqe; unsigned idx;
+ while (FSqLocal-__atomic_load_n(FSqHead,__ATOMIC_ACQUIRE)>=FSqEntries) submit();
+ sqe=FSqes+(idx=FSqLocal&*FSqMask); FSqArray[idx]=idx; FSqLocal++;
+ memset(sqe,0,sizeof(*sqe)); return sqe;
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Submits every queued entry with one syscall and, if 'wait', blocks until
+//! at least one completion is available. Returns -1 on error (e.g. EINTR).
+int cURing::submit(bool wait){ unsigned n;
+ __atomic_store_n(FSqTail,FSqLocal,__ATOMIC_RELEASE);
+ n=FSqLocal-__atomic_load_n(FSqHead,__ATOMIC_ACQUIRE);
+ if (!n && !wait) return 0;
+ return syscall(__NR_io_uring_enter,FRing,n,wait?1:0,wait?IORING_ENTER_GETEVENTS:0,nullptr,0);
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Oldest unseen completion (nullptr if none); see '::advance'.
+io_uring_cqe* cURing::peek(){ unsigned head=*FCqHead;
+ if (head==__atomic_load_n(FCqTail,__ATOMIC_ACQUIRE)) return nullptr;
+ return FCqes+(head&*FCqMask);
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+void cURing::advance(){ __atomic_store_n(FCqHead,*FCqHead+1,__ATOMIC_RELEASE); }
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+//! Gives back the provided buffer 'bid' (see IORING_CQE_BUFFER_SHIFT). The
+//! ring is indexed as a plain array: in C++ the empty struct wrapping the
+//! 'bufs' flexible array takes room and 'bufs' is not at offset 0.
+void cURing::recycle(unsigned bid){ io_uring_buf *buf; uint16_t tail=FBufRing->tail;
+ buf=reinterpret_cast<io_uring_buf*>(FBufRing)+(tail&(FnBuffers-1));
+ buf->addr=reinterpret_cast<uint64_t>(buffer(bid)); buf->len=FBufSize; buf->bid=bid;
+ __atomic_store_n(&FBufRing->tail,static_cast<uint16_t>(tail+1),__ATOMIC_RELEASE);
+}
+
+}
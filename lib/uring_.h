@@ -0,0 +1,61 @@
+/**
+ * @file uring_.h
+ */
+
+#ifndef _URING_ //#############################################################
+#define _URING_
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "exception_.h"
+
+namespace CUTIL {
+
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+/*                                   cURing                                  */
+/*! \author Francisco Neves                                                  */
+/*! \date 2026.10.17 ( Last modified 2026.10.17 )                            */
+/*! \brief io_uring wrapper (raw syscalls, no liburing)                      */
+/*%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%*/
+//! \details
+//! ** Maps the submission/completion rings of one io_uring instance and
+//!   registers a ring of 'nBuffers' provided buffers of 'bufSize' bytes each
+//!   (buffer group 'bgid', see IOSQE_BUFFER_SELECT).
+//! ** The constructor throws if io_uring (or provided buffer rings, Linux
+//!   5.19) is not available, so that the caller can fall back to epoll.
+//! ** Not thread safe: one instance per thread, e.g:
+//!   sqe=ring.get(); sqe->opcode=...; ring.submit(true);
+//!   while ((cqe=ring.peek())){ ...; ring.advance(); }
+class cURing {
+public: enum { bgid=0 };
+private: //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+    int FRing;
+    void *FSqMap, *FCqMap; size_t FSqSize, FCqSize;
+    io_uring_sqe *FSqes; size_t FSqesSize;
+    unsigned *FSqHead, *FSqTail, *FSqMask, *FSqArray, FSqEntries, FSqLocal;
+    unsigned *FCqHead, *FCqTail, *FCqMask;
+    io_uring_cqe *FCqes;
+    io_uring_buf_ring *FBufRing; size_t FBufRingSize;
+    uint8_t *FBuffers;
+    unsigned FnBuffers, FBufSize;
+    cURing(cURing&){ } //> disable.
+    void free();
+public: //:::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+    explicit cURing(unsigned entries, unsigned nBuffers, unsigned bufSize);
+    virtual ~cURing(){ free(); }
+    //.........................................................................
+    io_uring_sqe* get();
+    int submit(bool wait=false);
+    io_uring_cqe* peek();
+    void advance();
+    //.........................................................................
+    inline uint8_t* buffer(unsigned bid){ return FBuffers+static_cast<size_t>(bid)*FBufSize; }
+    inline unsigned bufferSize(){ return FBufSize; }
+    void recycle(unsigned bid);
+};
+
+}
+
+#endif // _URING_ #############################################################
@@ -12,7 +12,10 @@ using namespace CUTIL;
 
 
 
-int main(){
+// usage: wrapper [config.csv] [--handoff <socket> [--listeners-only]]
+//                [--log-level debug|info|warning|error|off] [--stats <seconds>]
+//                [--python-behaviours]
+int main(int argc, char **argv){
 
     //py::scoped_interpreter guard{}; // start interpreter, dies when out of scope
     //py::module Behaviours = py::module_::import("Behaviours");
@@ -22,10 +25,25 @@ int main(){
     py::scoped_interpreter guard{};
 
     Wrapper* wrapper = new Wrapper();
-    wrapper->readCSV("config.csv");
+    char *config = (char*)"config.csv";
+    std::string handoff;
+    bool everything = true; // connections and register maps as well
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--handoff" && i + 1 < argc) handoff = argv[++i];
+        else if (arg == "--listeners-only") everything = false;
+        else if (arg == "--log-level" && i + 1 < argc) cLog::setLevel(cLog::level(argv[++i]));
+        else if (arg == "--stats" && i + 1 < argc) wrapper->setStatsPeriod(std::stoi(argv[++i]));
+        else if (arg == "--python-behaviours") wrapper->setNativeBehaviours(false);
+        else config = argv[i];
+    }
+    cLog::start();
+    if (!handoff.empty()) wrapper->setHandoff(handoff, everything, everything);
+    wrapper->readCSV(config);
     wrapper->processCSV();
     wrapper->printStatus();
     wrapper->start();
+    cLog::stop();
    
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,101 @@
+#include "behaviour.h"
+#include "channel.h"
+
+#include <map>
+#include <stdexcept>
+#include <cmath>
+#include <ctime>
+#include <chrono>
+#include <random_.h>
+
+
+static Behaviour* newBsetpoint(const std::vector<std::string> &params){ return new Bsetpoint(params); }
+static Behaviour* newBcopy(const std::vector<std::string> &params){ return new Bcopy(params); }
+static Behaviour* newBsinwave(const std::vector<std::string> &params){ return new Bsinwave(params); }
+
+// built in ones first (function static: usable from static initializers)
+static std::map<std::string, BehaviourFactory>& registry(){
+
+    static std::map<std::string, BehaviourFactory> factories = {
+        {"Bsetpoint", newBsetpoint},
+        {"Bcopy", newBcopy},
+        {"Bsinwave", newBsinwave}
+    };
+    return factories;
+}
+
+void registerBehaviour(const std::string &name, BehaviourFactory factory){
+    registry()[name] = factory;
+}
+
+// nullptr if there is no native behaviour 'name'
+Behaviour* createBehaviour(const std::string &name, const std::vector<std::string> &params){
+
+    auto it = registry().find(name);
+    if(it == registry().end())
+        return nullptr;
+    return it->second(params);
+}
+
+// Parameter 'i' as a number (as float() in Python: throws if missing or invalid).
+static double parameter(const std::vector<std::string> &params, size_t i){
+
+    if(i >= params.size())
+        throw std::invalid_argument("Missing behaviour parameter " + std::to_string(i));
+    return std::stod(params[i]);
+}
+
+
+// Random value within [constant-range, constant+range].
+Bsetpoint::Bsetpoint(const std::vector<std::string> &params){
+
+    constant = parameter(params, 0);
+    range = parameter(params, 1);
+}
+
+void Bsetpoint::updateValue(){
+
+    // behaviours are only called with the GIL held: one generator is enough
+    static CMATH::cRandom generator(static_cast<long>(time(nullptr)));
+    value = constant + generator.random(-range, range);
+}
+
+
+// Copy of the value of another channel of the server.
+Bcopy::Bcopy(const std::vector<std::string> &params){
+
+    if(params.empty())
+        throw std::invalid_argument("Missing behaviour parameter 0");
+    copy_channel_name = params[0];
+    ref_channel = nullptr;
+    missing = false;
+}
+
+void Bcopy::updateValue(){
+
+    if(ref_channel == nullptr)
+        ref_channel = channel->findChannelbyName(copy_channel_name);
+    if(ref_channel == nullptr){
+        if(!missing)
+            CLOG(llError, "Channel %s: channel %s not found", channel->getName().c_str(), copy_channel_name.c_str());
+        missing = true;
+        return;
+    }
+    value = ref_channel->getBehaviourValue();
+}
+
+
+// constant + amp*sin(t*freq + phase), t in seconds since the epoch.
+Bsinwave::Bsinwave(const std::vector<std::string> &params){
+
+    constant = parameter(params, 0);
+    amp = parameter(params, 1);
+    freq = parameter(params, 2);
+    phase = parameter(params, 3);
+}
+
+void Bsinwave::updateValue(){
+
+    double t = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+    value = constant + amp*std::sin(t*freq + phase);
+}
@@ -0,0 +1,76 @@
+#ifndef Behaviour_H
+#define Behaviour_H
+
+#include <string>
+#include <vector>
+
+class Channel;
+
+// Behaviour implemented in C++: the same contract as the Python ones (see
+// Behaviours.py) without the interpreter, so channels using it are updated
+// without any pybind11 call. Called with the GIL held, like the Python ones.
+class Behaviour {
+
+public:
+    Behaviour():value(0),channel(nullptr){};
+    virtual ~Behaviour(){};
+
+    void setChannel(Channel *channel){this->channel = channel;};
+
+    virtual void updateValue() = 0;
+    virtual double getValue(){return value;};
+    virtual void setValue(double value){this->value = value;};
+
+protected:
+    double value;
+    Channel *channel;
+};
+
+// Native behaviours by name, consulted before importing the Python class of
+// a channel (see Wrapper::processCSV). Bsetpoint, Bcopy and Bsinwave are
+// built in; a factory returns nullptr (or throws) on invalid parameters.
+typedef Behaviour* (*BehaviourFactory)(const std::vector<std::string> &params);
+
+void registerBehaviour(const std::string &name, BehaviourFactory factory);
+Behaviour* createBehaviour(const std::string &name, const std::vector<std::string> &params);
+
+
+class Bsetpoint: public Behaviour {
+
+public:
+    explicit Bsetpoint(const std::vector<std::string> &params);
+    void updateValue() override;
+    void setValue(double value) override {constant = value;};
+
+private:
+    double constant;
+    double range;
+};
+
+class Bcopy: public Behaviour {
+
+public:
+    explicit Bcopy(const std::vector<std::string> &params);
+    void updateValue() override;
+
+private:
+    std::string copy_channel_name;
+    Channel *ref_channel; // found on the first update
+    bool missing; // reported once
+};
+
+class Bsinwave: public Behaviour {
+
+public:
+    explicit Bsinwave(const std::vector<std::string> &params);
+    void updateValue() override;
+
+private:
+    double constant;
+    double amp;
+    double freq;
+    double phase;
+};
+
+
+#endif // Behaviour_H
@@ -3,6 +3,9 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/embed.h>  // python interpreter
 #include <pybind11/stl.h>  // type conversion
+#include <cmath>
+#include <cstring>
+#include <algorithm>
 #include "server_wrapper.h"
 
 namespace py = pybind11;
@@ -19,6 +22,14 @@ Channel::Channel(int first_register, int n_registers,  Rtype register_type, Dtyp
     dtype = data_type;
     rtype = register_type;
     endiantype = endian;
+    mb_server = nullptr;
+    group = nullptr;
+    group_index = 0;
+    capabilities = 0;
+    ttl = 0;
+    period = 0;
+    updated_ms = 0;
+    staged_n = 0;
 
 }
 
@@ -33,79 +44,175 @@ void Channel::setName(std::string name){
 
 void Channel::setBehaviour(char *behaviour_name, std::vector<string> params){
 
+    native.reset();
+    group = nullptr;
     py::object Behaviours = py::module_::import("Behaviours");
     behaviour = Behaviours.attr(behaviour_name)(params);
     behaviour.attr("_setChannelObj")(this);
+    resolveBehaviour();
 
 }
 
+// Native behaviour (owned by the channel): no Python object nor GIL round trip.
+void Channel::setBehaviour(Behaviour *native_behaviour){
+
+    native.reset(native_behaviour);
+    native->setChannel(this);
+    group = nullptr;
+    behaviour = py::none();
+    resolveBehaviour();
+}
+
+// Row 'index' of a vectorized behaviour (see BehaviourGroup::add).
+void Channel::setBehaviour(BehaviourGroup *behaviour_group, int index){
+
+    native.reset();
+    group = behaviour_group;
+    group_index = index;
+    behaviour = py::none();
+    resolveBehaviour();
+}
+
+// The Python object of the behaviour, or a reference to the native one (same
+// methods), e.g. for Python behaviours copying this channel. None for a
+// vectorized behaviour (see getBehaviourValue).
+py::object Channel::getBehaviour(){
+
+    if (native)
+        return py::cast(native.get(), py::return_value_policy::reference);
+    return behaviour;
+}
+
+// Current value of the behaviour (GIL held).
+double Channel::getBehaviourValue(){
+
+    if (native)
+        return native->getValue();
+    if (group)
+        return group->getValue(group_index);
+    if (!(capabilities & CAN_GET))
+        return 0;
+    return get_method().cast<double>();
+}
+
+// Resolves the bound methods of the behaviour once (no attribute lookup per
+// update or write). Those of a previous behaviour are dropped, and the server
+// rebuilds its tick list.
+void Channel::resolveBehaviour(){
+
+    auto resolve = [this](const char *method, py::object &handle, unsigned capability){
+        handle = py::none();
+        if (py::hasattr(behaviour, method))
+            handle = behaviour.attr(method);
+        if (!handle.is_none())
+            capabilities |= capability;
+    };
+
+    capabilities = 0;
+    if (native || group) {
+        update_method = get_method = set_method = py::none();
+        capabilities = CAN_UPDATE | CAN_GET | CAN_SET;
+    } else {
+        resolve("updateValue", update_method, CAN_UPDATE);
+        resolve("getValue", get_method, CAN_GET);
+        resolve("setValue", set_method, CAN_SET);
+    }
+
+    if (mb_server != nullptr)
+        mb_server->invalidateTick();
+}
+
 
 
 void Channel::updateValue(){
 
     py::gil_scoped_acquire acquire;
 
-    if (behaviour.attr("getValue").is_none()) {
-            std::cout << "Python object doesn't have 'getValue' method." << std::endl;
+    if (!(capabilities & CAN_GET)) {
+            CLOG(llWarning, "Channel %s: Python object doesn't have 'getValue' method.", name.c_str());
             return;
     }
 
-    if (behaviour.attr("updateValue").is_none()) {
-            std::cout << "Python object doesn't have 'updateValue' method." << std::endl;
+    if (!(capabilities & CAN_UPDATE)) {
+            CLOG(llWarning, "Channel %s: Python object doesn't have 'updateValue' method.", name.c_str());
             return;
     }
 
+    if (!evaluate())
+        return;
+
+    // both halves are published at once (see cMODBUSServer::mappingLock)
+    mb_server->mappingLock().writeLock();
+    publish();
+    mb_server->mappingLock().writeUnlock();
+
+}
+
+// Calls the behaviour (GIL held, CAN_UPDATE and CAN_GET) and converts its value
+// into the registers to publish, without touching the mapping. Returns false
+// on unknown datatype.
+bool Channel::evaluate(){
+
+    updated_ms = cMilliseconds();
+    if (native) {
+        native->updateValue();
+        return stage(native->getValue());
+    }
+    if (group) // updated before its channels (see WServer::updateChannels)
+        return stage(group->getValue(group_index));
+
+    update_method();
+    py::object value = get_method();
+    if (dtype == SHORT)
+        return stage(value.cast<uint16_t>());
+    if (dtype == BOOL)
+        return stage(value.cast<bool>());
+    return stage(value.cast<float>());
+}
+
+// Converts 'value' into the registers of the channel datatype.
+bool Channel::stage(double value){
 
-    behaviour.attr("updateValue")();
-        
     if(dtype == FLOAT || dtype == INTEGER) {
         uint32_t value32;
+        float valuef = value;
 
         if (dtype == INTEGER){
-            //std::cout << "Getting integer" << std::endl;
-            //int valueI = (int) behaviour.attr("getValue")().cast<float>();
-            float valuef = behaviour.attr("getValue")().cast<float>();
             value32 = (int) valuef;
-
-            //std::cout << "Converting " << valuef << " " << valuef << std::endl;
-            //value32 = *reinterpret_cast<uint32_t*>(&valueI);
         }
-        else if (dtype == FLOAT){
+        else {
             // Convert the float into its 32-bit binary representation
-            float valuef = behaviour.attr("getValue")().cast<float>();
             value32 = *reinterpret_cast<uint32_t*>(&valuef);
-
-            //std::cout << "the value: " << valuef << std::endl;
-        }
-
-
-        uint16_t registers[2];
-        registers[0] = (value32 >> 16) & 0xFFFF;  // High 16 bits
-        registers[1] = value32 & 0xFFFF;          // Low 16 bits
-
-        if(endiantype==BIG){
-            setRegister(reg_start, registers[0]);
-            setRegister(reg_start+1, registers[1]);
-        } if(endiantype==LITTLE){
-            setRegister(reg_start, registers[1]);
-            setRegister(reg_start+1, registers[0]);
         }
 
+        uint16_t high = (value32 >> 16) & 0xFFFF;
+        uint16_t low = value32 & 0xFFFF;
+        staged[0] = endiantype==BIG ? high : low;
+        staged[1] = endiantype==BIG ? low : high;
+        staged_n = 2;
 
     } else if (dtype == SHORT) {
 
-        uint16_t value16 = behaviour.attr("getValue")().cast<uint16_t>();
-        setRegister(reg_start, value16);
+        staged[0] = static_cast<uint16_t>(static_cast<int>(value));
+        staged_n = 1;
 
     } else if (dtype == BOOL) {
-            
-        bool valueb = behaviour.attr("getValue")().cast<bool>();
-        setRegister(reg_start, valueb);
+
+        staged[0] = value != 0;
+        staged_n = 1;
 
     } else{
-            std::cout << "Unknown datatype" << std::endl;
+            CLOG(llError, "Channel %s: unknown datatype", name.c_str());
+            return false;
     }
+    return true;
+}
 
+// Writes the registers of the last evaluate() (mappingLock write side held).
+void Channel::publish(){
+
+    for(int i=0; i<staged_n; i++)
+        setRegister(reg_start + i, staged[i]);
 }
 
 void Channel::setRegister(int reg, uint16_t value){
@@ -119,25 +226,58 @@ void Channel::setRegister(int reg, uint16_t value){
     } else if(rtype == DESCRETEINPUT) {
         mb_server->getMapping()->tab_input_bits[reg] = value;
     }else{
-        std::cout << "Unknown register type" << std::endl;
+        CLOG(llError, "Channel %s: unknown register type", name.c_str());
     }
 }
 
 
+uint16_t Channel::getRegister(int reg){
+
+    if(rtype == HOLDINGREGISTER) {
+        return mb_server->getMapping()->tab_registers[reg];
+    } else if(rtype == COIL) {
+        return mb_server->getMapping()->tab_bits[reg];
+    } else if(rtype == INPUTREGISTER) {
+        return mb_server->getMapping()->tab_input_registers[reg];
+    } else if(rtype == DESCRETEINPUT) {
+        return mb_server->getMapping()->tab_input_bits[reg];
+    }
+    return 0;
+}
+
+// The current content of the channel registers, never torn (seqlock read,
+// see cMODBUSServer::mappingLock).
+std::vector<uint16_t> Channel::readRegisters(){
+
+    std::vector<uint16_t> registers(reg_n);
+    unsigned seq;
+    do {
+        seq = mb_server->mappingLock().readBegin();
+        for(int i=0; i<reg_n; i++)
+            registers[i] = getRegister(reg_start + i);
+    } while (mb_server->mappingLock().readRetry(seq));
+    return registers;
+}
+
+// Applies to 'registers' (the channel content) the 'n' values written from
+// 'first_register' on; the registers they do not cover are kept.
+void Channel::mergeRegisters(std::vector<uint16_t> &registers, int first_register, const uint16_t *values, int n){
+
+    for(int i=0; i<reg_n; i++){
+        int k = reg_start + i - first_register;
+        if(k >= 0 && k < n)
+            registers[i] = values[k];
+    }
+}
+
 
 void Channel::setBehaviourValue(std::vector<uint16_t> registers){
 
-    std::cout << "First register: " << reg_start << std::endl;
-    std::cout << "N register: " << reg_n << std::endl;
-    std::cout << "Datatype: " << dtype << std::endl;
-    std::cout << "Registertype: " << rtype << std::endl;
-    
-    //py::gil_scoped_acquire acquire;
-    py::gil_scoped_release release;
+    // called by the behaviour thread (see WServer::applyWrites)
     py::gil_scoped_acquire acquire;
     
-    if (behaviour.attr("setValue").is_none()) {
-            std::cout << "Python object doesn't have 'some_method'." << std::endl;
+    if (!(capabilities & CAN_SET)) {
+            CLOG(llWarning, "Channel %s: Python object doesn't have 'setValue' method.", name.c_str());
             return;
     }
 
@@ -149,8 +289,8 @@ void Channel::setBehaviourValue(std::vector<uint16_t> registers){
         } if(endiantype==LITTLE){
             value = (static_cast<int32_t>(registers[1]) << 16) | registers[0];
         }
-        std::cout << "Value: " << value << std::endl;
-        behaviour.attr("setValue")(value);
+        CLOG(llDebug, "Write %s (%s %d+%d): %d", name.c_str(), RtypeToString(rtype).c_str(), reg_start, reg_n, value);
+        callSetValue(value);
     }
     else if (dtype == FLOAT){
         // Convert the float into its 32-bit binary representation
@@ -163,23 +303,23 @@ void Channel::setBehaviourValue(std::vector<uint16_t> registers){
         }
 
         float value = *reinterpret_cast<float*>(&value32);
-        std::cout << "Value: " << value << std::endl;
-        behaviour.attr("setValue")(value);
+        CLOG(llDebug, "Write %s (%s %d+%d): %g", name.c_str(), RtypeToString(rtype).c_str(), reg_start, reg_n, value);
+        callSetValue(value);
 
     } else if (dtype == SHORT) {
 
         int16_t value = static_cast<int16_t>( registers[0]);
-        std::cout << "Value: " << value << std::endl;
-        behaviour.attr("setValue")(value);
+        CLOG(llDebug, "Write %s (%s %d+%d): %d", name.c_str(), RtypeToString(rtype).c_str(), reg_start, reg_n, value);
+        callSetValue(value);
 
     } else if (dtype == BOOL) {
             
         bool value = static_cast<bool>( registers[0]);
-        behaviour.attr("setValue")(value);
-        std::cout << "Value: " << value << std::endl;
+        CLOG(llDebug, "Write %s (%s %d+%d): %d", name.c_str(), RtypeToString(rtype).c_str(), reg_start, reg_n, value);
+        callSetValue(value);
 
     } else{
-            std::cout << "Unknown datatype" << std::endl;
+            CLOG(llError, "Channel %s: unknown datatype", name.c_str());
     }
     
 
@@ -191,6 +331,98 @@ Channel* Channel::findChannelbyName(std::string name){
 }
 
 
+BehaviourGroup::BehaviourGroup(py::object behaviour_class, unsigned period){
+
+    this->behaviour_class = behaviour_class;
+    this->period = period;
+    update_values = behaviour_class.attr("updateValues");
+    set_values = py::hasattr(behaviour_class, "setValues") ? behaviour_class.attr("setValues") : py::none();
+    name = behaviour_class.attr("__name__").cast<std::string>();
+    built = 0;
+}
+
+// A channel with 'params' (numbers, as float() in Python): its row index.
+// A parameter that is not a number is NaN, as a missing one.
+int BehaviourGroup::add(const std::vector<std::string> &params){
+
+    std::vector<double> row;
+    for (const std::string &param : params) {
+        if (param.find_first_not_of(" \t") == std::string::npos) // empty trailing CSV fields
+            continue;
+        try {
+            row.push_back(std::stod(param));
+        } catch (const std::exception &) { // invalid_argument, out_of_range
+            CLOG(llWarning, "%s: parameter %zu of row %zu is not a number: '%s'",
+                 name.c_str(), row.size(), rows.size(), param.c_str());
+            row.push_back(NAN);
+        }
+    }
+    rows.push_back(row);
+    return rows.size() - 1;
+}
+
+// (Re)allocates the arrays for all the channels added, keeping the values.
+// The parameters are taken from the CSV: channels are added before the first
+// tick, so setValues has not changed them yet.
+void BehaviourGroup::build(){
+
+    size_t n = rows.size(), k = 0;
+    for (const std::vector<double> &row : rows)
+        k = std::max(k, row.size());
+
+    py::array_t<double> new_params(std::vector<ssize_t>{(ssize_t)n, (ssize_t)k});
+    py::array_t<double> new_values((ssize_t)n);
+    double *p = new_params.mutable_data();
+    double *v = new_values.mutable_data();
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < k; j++)
+            p[i*k + j] = j < rows[i].size() ? rows[i][j] : NAN;
+        v[i] = i < built ? values.data()[i] : 0;
+    }
+    params = new_params;
+    values = new_values;
+    built = n;
+}
+
+// GIL held: one call for every channel of the group. Returns false if the
+// values were not updated.
+bool BehaviourGroup::update(){
+
+    if (built != rows.size())
+        build();
+    if (built == 0)
+        return false;
+
+    py::object result = update_values(params, values);
+    auto out = py::array_t<double, py::array::c_style | py::array::forcecast>::ensure(result);
+    if (!out || out.size() != built) {
+        CLOG(llError, "%s.updateValues: expected %zu values", name.c_str(), built);
+        return false;
+    }
+    if (out.data() != values.data()) // not updated in place
+        memcpy(values.mutable_data(), out.data(), built*sizeof(double));
+    return true;
+}
+
+double BehaviourGroup::getValue(int index){
+    return (size_t)index < built ? values.data()[index] : 0;
+}
+
+// Write from a master (behaviour thread): setValues(params, values, index,
+// value) or, by default, the value itself until the next update.
+void BehaviourGroup::setValue(int index, double value){
+
+    if (set_values.is_none()) {
+        if ((size_t)index < built)
+            values.mutable_data()[index] = value;
+        return;
+    }
+    if (built != rows.size())
+        build();
+    set_values(params, values, index, value);
+}
+
+
 
 PYBIND11_EMBEDDED_MODULE(cppobjects, m){
 
@@ -226,7 +458,14 @@ PYBIND11_EMBEDDED_MODULE(cppobjects, m){
         .def("getTotalRegister", &Channel::getTotalRegister)
         .def("getRegisterType", &Channel::getRegisterType)
         .def("findChannelbyName", &Channel::findChannelbyName, py::return_value_policy::reference)
-        .def("getBehaviour", &Channel::getBehaviour);
+        .def("getBehaviour", &Channel::getBehaviour)
+        .def("getBehaviourValue", &Channel::getBehaviourValue);
+
+    // native behaviours, as returned by Channel.getBehaviour()
+    py::class_<Behaviour>(m, "NativeBehaviour")
+        .def("updateValue", &Behaviour::updateValue)
+        .def("getValue", &Behaviour::getValue)
+        .def("setValue", &Behaviour::setValue);
 
 }
 
@@ -3,13 +3,19 @@
 
 #include <pybind11/pybind11.h>
 #include <pybind11/embed.h>  // Everything needed for embedding
+#include <pybind11/numpy.h>
 #include <modbus_.h>
+#include <log_.h>
 #include <vector>
+#include <atomic>
+#include <memory>
+#include "behaviour.h"
 
 namespace py = pybind11;
 using namespace CUTIL;
 
 class WServer;
+class BehaviourGroup;
 
 
 enum Dtype {
@@ -31,6 +37,13 @@ enum Endian{
     LITTLE
 };
 
+// methods implemented by the behaviour (see Channel::getCapabilities)
+enum Capability{
+    CAN_UPDATE=1, // updateValue
+    CAN_GET=2, // getValue
+    CAN_SET=4 // setValue
+};
+
 
 class Channel {
 
@@ -44,18 +57,43 @@ public:
     std::string getName(){return name;};
     void setName(std::string name);
     Rtype getRegisterType(){return rtype;};
-    py::object getBehaviour(){return behaviour;};
+    py::object getBehaviour();
+    double getBehaviourValue();
+    unsigned getCapabilities(){return capabilities;};
+    // lazy evaluation: refreshed when read and older than 'ttl' ms (0: every tick)
+    void setTTL(unsigned ms){ttl = ms;};
+    unsigned getTTL(){return ttl;};
+    bool isStale(uint64_t now_ms){return now_ms - updated_ms.load(std::memory_order_relaxed) >= ttl;};
+    // update period (ms) of an eager channel, 0: the server default (see WServer::updateChannels)
+    void setPeriod(unsigned ms){period = ms;};
+    unsigned getPeriod(){return period;};
 
     void updateValue();
+    // updateValue in two steps, for a batch of channels (see WServer::updateChannels)
+    bool evaluate();
+    void publish();
     void setBehaviour(char *behaviour_name, std::vector<std::string> params);
+    void setBehaviour(Behaviour *native_behaviour);
+    void setBehaviour(BehaviourGroup *behaviour_group, int index);
+    BehaviourGroup* getBehaviourGroup(){return group;};
     void setServer(WServer* server);
     void setBehaviourValue(std::vector<uint16_t> registers);
+    std::vector<uint16_t> readRegisters();
+    void mergeRegisters(std::vector<uint16_t> &registers, int first_register, const uint16_t *values, int n);
 
     Channel* findChannelbyName(std::string name);
 
 
 private:
     py::object behaviour;
+    std::unique_ptr<Behaviour> native; // instead of 'behaviour' (see behaviour.h)
+    BehaviourGroup *group; // or vectorized: row 'group_index' of the group
+    int group_index;
+    // bound methods of the behaviour, resolved once it is set (see resolveBehaviour)
+    py::object update_method;
+    py::object get_method;
+    py::object set_method;
+    unsigned capabilities;
     int reg_start;
     int reg_n;
     std::string name;
@@ -63,12 +101,60 @@ private:
     Rtype rtype;
     Endian endiantype;
     WServer *mb_server;
+    unsigned ttl;
+    unsigned period;
+    std::atomic<uint64_t> updated_ms; // last updateValue (cMilliseconds)
+    uint16_t staged[2]; // registers of the last evaluate()
+    int staged_n;
 
     void setRegister(int reg, uint16_t value);
+    uint16_t getRegister(int reg);
+    void resolveBehaviour();
+    bool stage(double value);
+    template <typename T> void callSetValue(T value);
 
 };
 
 
+// Vectorized Python behaviour: a class with 'vectorized = True' (see
+// VectorizedBehavior in Behaviours.py) is not instantiated per channel. Its
+// channels in a server with the same period form a group whose parameters
+// and values are NumPy arrays (one row per channel), updated by one call per
+// tick: values = updateValues(params, values) (see WServer::updateChannels).
+class BehaviourGroup {
+
+public:
+    BehaviourGroup(py::object behaviour_class, unsigned period);
+
+    py::object getClass(){return behaviour_class;};
+    unsigned getPeriod(){return period;};
+    int add(const std::vector<std::string> &params);
+    bool update();
+    double getValue(int index);
+    void setValue(int index, double value);
+
+private:
+    py::object behaviour_class;
+    py::object update_values;
+    py::object set_values; // optional: setValues(params, values, index, value)
+    std::string name;
+    unsigned period; // of its channels (see Channel::getPeriod)
+    std::vector<std::vector<double>> rows; // parameters of the channels
+    py::array_t<double> params; // channels x parameters (NaN if missing)
+    py::array_t<double> values;
+    size_t built; // rows in the arrays
+
+    void build();
+};
+
+
+template <typename T> void Channel::callSetValue(T value){
+    if (native) native->setValue(value);
+    else if (group) group->setValue(group_index, value);
+    else set_method(value);
+}
+
+
 
 
 
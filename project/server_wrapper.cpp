@@ -1,6 +1,10 @@
 #include <server_wrapper.h>
 #include <chrono>
 #include <thread>
+#include <unordered_map>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <channel.h>
 
 #include <pybind11/pybind11.h>
@@ -14,15 +18,38 @@ namespace py = pybind11;
 class Channel;
 
 
-WServer::WServer(int iport){
+WServer::WServer(int iport, CUTIL::cMODBUSReactor reactor):CUTIL::cMODBUSServer(10, reactor), write_queue(WRITE_QUEUE_SIZE){
 
-    CUTIL::cMODBUSServer();
     port = iport;
+    workers = 1;
+    udp_workers = 0;
+    lazy_ttl = 0;
+    lazy_channels = 0;
+    update_period = 1000;
+    tick_dirty = true;
+    write_pending = false;
+    write_drops = 0;
+    write_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 }
 
-WServer::WServer(){
+WServer::WServer(CUTIL::cMODBUSReactor reactor):CUTIL::cMODBUSServer(10, reactor), write_queue(WRITE_QUEUE_SIZE){
 
-    CUTIL::cMODBUSServer();
+    workers = 1;
+    udp_workers = 0;
+    lazy_ttl = 0;
+    lazy_channels = 0;
+    update_period = 1000;
+    tick_dirty = true;
+    write_pending = false;
+    write_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+WServer::~WServer(){
+
+    if (write_event != -1)
+        ::close(write_event);
+    py::gil_scoped_acquire acquire; // the groups hold NumPy arrays
+    groups.clear();
 }
 
 void WServer::addChannel(Channel *channel){
@@ -46,102 +73,367 @@ void WServer::addChannel(Channel *channel){
             setMaxDiscrete(last_reg);
     }
 
+    // every register of the channel points to it, and to the other channels
+    // overlapping it (each one gets the writes, see OnRequest)
+    vector<vector<Channel*>> &index = channel_index[rtype];
+    if((int)index.size() < last_reg)
+        index.resize(last_reg);
+    for(int reg = channel->getStartingRegister(); reg < last_reg; reg++)
+        index[reg].push_back(channel);
+
+    if(channel->getBehaviourGroup() != nullptr)
+        channel->setTTL(0); // updated with its group, every tick
+    else if(channel->getTTL() == 0)
+        channel->setTTL(lazy_ttl);
+    if(channel->getTTL() > 0)
+        lazy_channels++;
+
     channel->setServer(this);
     channels.push_back(channel);
+    tick_dirty = true;
 }
 
 void WServer::start(){
 
     std::string address= getLocalIP("127.0.0.1");
 
-    std::cout << "Started serving server "<< getID() <<" on port: " << port << std::endl;
-    connect_TCP(address, port, 2);
-    execute();
-
-    while (true) {
-        updateChannels();
-        std::this_thread::sleep_for(std::chrono::seconds(1));
+    std::cout << "Started serving server "<< getID() <<" on port: " << port
+              << " (" << workers << " worker(s))" << std::endl;
+    connect_TCP(address, port, SOMAXCONN, workers);
+    if (!unix_socket.empty()) {
+        std::cout << "Also serving server " << getID() << " on unix socket: " << unix_socket << std::endl;
+        attach_UNIX(unix_socket, SOMAXCONN);
+    }
+    if (udp_workers > 0) {
+        std::cout << "Also serving server " << getID() << " on UDP port: " << port
+                  << " (" << udp_workers << " worker(s))" << std::endl;
+        attach_UDP(address, port, udp_workers);
     }
+    if (!mapping_image.empty()) {
+        setMappingImage(mapping_image);
+        mapping_image.clear();
+    }
+    if (!handed_connections.empty()) {
+        std::cout << "Server " << getID() << " took over " << handed_connections.size()
+                  << " connection(s)" << std::endl;
+        for (int socket : handed_connections)
+            adopt(socket);
+        handed_connections.clear();
+    }
+    execute();
 }
 
 
- void WServer::OnRequest(unsigned req_length)  {  // 'override' is optional but recommended for clarity
+ void WServer::OnRequest(const uint8_t *req, unsigned req_length)  {  // 'override' is optional but recommended for clarity
         //std::cout << "THA NEW REQUEST" << req_length << std::endl;
-        uint8_t function_code = query()[7];
+        // invalid requests never get here (answered by cMODBUSServer::exception):
+        // the quantities, byte counts and addresses below are within the tables
+        uint8_t function_code = req[7];
         uint16_t reg_address;
         std::vector<uint16_t> reg_values;
         Rtype rtype;
 
+        if(lazy_channels > 0){
+            // reads: stale lazy channels are evaluated before the reply
+            uint16_t address = (req[8] << 8) | req[9];
+            uint16_t n = (req[10] << 8) | req[11];
+            if(function_code == MODBUS_FC_READ_COILS)
+                refreshChannels(COIL, address, n);
+            else if(function_code == MODBUS_FC_READ_DISCRETE_INPUTS)
+                refreshChannels(DESCRETEINPUT, address, n);
+            else if(function_code == MODBUS_FC_READ_HOLDING_REGISTERS ||
+                    function_code == MODBUS_FC_WRITE_AND_READ_REGISTERS)
+                refreshChannels(HOLDINGREGISTER, address, n);
+            else if(function_code == MODBUS_FC_READ_INPUT_REGISTERS)
+                refreshChannels(INPUTREGISTER, address, n);
+        }
+
         if(function_code == MODBUS_FC_WRITE_SINGLE_COIL){
 
             // Write Single Coil (0x05)
             rtype = COIL;
-            reg_address = (query()[8] << 8) | query()[9];
-            uint16_t coil_value = (query()[10] << 8) | query()[11];
+            reg_address = (req[8] << 8) | req[9];
+            uint16_t coil_value = (req[10] << 8) | req[11];
             reg_values.push_back(coil_value);
 
         } else if(function_code == MODBUS_FC_WRITE_SINGLE_REGISTER){
             // Write Single Register (0x06)
             rtype = HOLDINGREGISTER;
-            reg_address = (query()[8] << 8) | query()[9];
-            uint16_t value_to_write = (query()[10] << 8) | query()[11];
+            reg_address = (req[8] << 8) | req[9];
+            uint16_t value_to_write = (req[10] << 8) | req[11];
             reg_values.push_back(value_to_write);
 
         } else if(function_code == MODBUS_FC_WRITE_MULTIPLE_COILS){
             // Write Multiple Coils (0x0F)
             rtype = COIL;
-            reg_address = (query()[8] << 8) | query()[9];
-            uint16_t num_coils = (query()[10] << 8) | query()[11];
-            //uint8_t byte_count = query()[12];
+            reg_address = (req[8] << 8) | req[9];
+            uint16_t num_coils = (req[10] << 8) | req[11];
+            //uint8_t byte_count = req[12];
 
             for (int i = 0; i < num_coils; i++) {
                 int byte_index = 13 + (i / 8);  // Start of data + byte offset
                 int bit_position = i % 8;       // Position of the bit within the byte
 
                 // Extract the current coil value (0 or 1)
-                uint8_t coil_value = (query()[byte_index] >> bit_position) & 0x01;
+                uint8_t coil_value = (req[byte_index] >> bit_position) & 0x01;
                 reg_values.push_back(coil_value);
             }
 
-            // Data starts from query()[13], process coils data here...
+            // Data starts from req[13], process coils data here...
         } else if(function_code == MODBUS_FC_WRITE_MULTIPLE_REGISTERS){
             // Write Multiple Registers (0x10)
 
             rtype = HOLDINGREGISTER;
-            reg_address  = (query()[8] << 8) | query()[9];
-            uint16_t num_registers  = (query()[10] << 8) | query()[11];
+            reg_address  = (req[8] << 8) | req[9];
+            uint16_t num_registers  = (req[10] << 8) | req[11];
 
             for (int i = 0; i < num_registers; i++) {
-                uint16_t value = (query()[13 + (i * 2)] << 8) | query()[14 + (i * 2)];
+                uint16_t value = (req[13 + (i * 2)] << 8) | req[14 + (i * 2)];
                 reg_values.push_back(value);
             }
 
+        } else if(function_code == MODBUS_FC_WRITE_AND_READ_REGISTERS){
+            // Read/Write Multiple Registers (0x17): only the write part
+            rtype = HOLDINGREGISTER;
+            reg_address = (req[12] << 8) | req[13];
+            uint16_t num_registers = (req[14] << 8) | req[15];
+            if (req_length < 17u + num_registers * 2)
+                num_registers = 0; // malformed: exception by the server
+
+            for (int i = 0; i < num_registers; i++) {
+                uint16_t value = (req[17 + (i * 2)] << 8) | req[18 + (i * 2)];
+                reg_values.push_back(value);
+            }
         }
 
 
         if(reg_values.size()>0){
 
-            for(int i=0; i<channels.size(); i++){
+            // every channel overlapped by the write gets its own slice, once
+            // (FC15/FC16 may span several channels, start or end in the middle
+            // of one, and channels may overlap each other)
+            vector<Channel*> written;
+            int last_reg = reg_address + reg_values.size();
+            for(int reg = reg_address; reg < last_reg; reg++)
+                for(Channel *channel : getChannels(rtype, reg))
+                    if(std::find(written.begin(), written.end(), channel) == written.end())
+                        written.push_back(channel);
+            for(Channel *channel : written)
+                queueWrite(channel, reg_address, reg_values.data(), reg_values.size());
+        }
+}
+
 
-                if(channels[i]->getStartingRegister() == reg_address &&
-                    channels[i]->getRegisterType() == rtype)
-                    channels[i]->setBehaviourValue(reg_values);
-            }
+// Network threads (any number): the registers are committed to the mapping
+// and replied to right after OnRequest, the behaviour is only told later.
+// Only the registers written to the channel are queued: the rest of it is
+// read when the write is applied (applyWrites), as two partial writes racing
+// on different workers must not each carry a stale half of the other.
+// Nothing is allocated: if the behaviour thread lags WRITE_QUEUE_SIZE writes
+// behind, the write is dropped (the mapping has it, the behaviour does not)
+// and counted in the statistics.
+void WServer::queueWrite(Channel *channel, int first_register, const uint16_t *values, int n){
+
+    ChannelWrite w;
+    w.channel = channel;
+    w.first_register = std::max(first_register, channel->getStartingRegister());
+    int last = std::min(first_register + n, channel->getStartingRegister() +
+                        std::min(channel->getTotalRegister(), CHANNEL_WRITE_MAX));
+    w.n = std::max(last - w.first_register, 0);
+    for (int i = 0; i < w.n; i++)
+        w.values[i] = values[w.first_register - first_register + i];
+    if (!write_queue.push(w))
+        write_drops++;
+    // one wakeup per batch: set again once the behaviour thread took the queue
+    if (!write_pending.exchange(true)) {
+        uint64_t one = 1;
+        if (::write(write_event, &one, sizeof(one)) == -1) { } // already signalled
+    }
+}
+
+// Behaviour thread only (holds the GIL): hands the queued writes to the
+// behaviours, once per channel (at its last write): its current registers
+// with all its queued writes merged over them, in order.
+void WServer::applyWrites(){
+
+    uint64_t count;
+    if (::read(write_event, &count, sizeof(count)) == -1) { } // not signalled
+    write_pending = false; // before popping: later writes signal again
+
+    vector<ChannelWrite> batch;
+    ChannelWrite w;
+    while (write_queue.pop(w))
+        batch.push_back(std::move(w));
+    if (batch.empty())
+        return;
+
+    std::unordered_map<Channel*, size_t> last; // channel -> its last write
+    std::unordered_map<Channel*, vector<uint16_t>> merged; // channel -> its registers
+    for (size_t i = 0; i < batch.size(); i++) {
+        Channel *channel = batch[i].channel;
+        last[channel] = i;
+        auto it = merged.find(channel);
+        if (it == merged.end())
+            it = merged.emplace(channel, channel->readRegisters()).first;
+        channel->mergeRegisters(it->second, batch[i].first_register, batch[i].values, batch[i].n);
+    }
+    for (size_t i = 0; i < batch.size(); i++)
+        if (last[batch[i].channel] == i) {
+            uint64_t t = cNanoseconds();
+            batch[i].channel->setBehaviourValue(merged[batch[i].channel]);
+            writeback_latency.record(cNanoseconds() - t);
         }
 }
 
+// Behaviour thread: logs the statistics of every worker (merged), and the
+// latency of the Python write-back.
+void WServer::logStatistics(){
+
+    std::unique_ptr<cMODBUSStats> total(new cMODBUSStats()); // histograms: ~100 kB
+    statistics(*total);
+    for (const string &line : total->report())
+        CLOG(llInfo, "Server %d %s", id, line.c_str());
+    if (writeback_latency.count())
+        CLOG(llInfo, "Server %d writeback n=%llu p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus", id,
+             (unsigned long long)writeback_latency.count(), writeback_latency.percentile(50) / 1e3,
+             writeback_latency.percentile(99) / 1e3, writeback_latency.percentile(99.9) / 1e3,
+             writeback_latency.max() / 1e3);
+    if (write_drops)
+        CLOG(llWarning, "Server %d writeback dropped=%llu (write queue full)", id,
+             (unsigned long long)write_drops.load());
+}
+
 
+// Behaviour thread: updates the eager channels whose period is due (see
+// nextUpdate). The GIL is taken once, the behaviours are called through
+// their bound methods (see Channel::resolveBehaviour), and the results
+// are published in a single critical section once all are evaluated (the
+// readers never wait on Python).
 void WServer::updateChannels(){
 
-    for(int i=0; i<channels.size(); i++){
-        channels[i]->updateValue();
+    applyWrites();
+
+    py::gil_scoped_acquire acquire;
+    if(tick_dirty)
+        buildTick();
+
+    // 'schedule' heap ordering: earliest deadline on top
+    auto later = [this](size_t a, size_t b){ return cohorts[a].deadline > cohorts[b].deadline; };
+    uint64_t now = cNanoseconds();
+    tick_ready.clear();
+    while(!schedule.empty() && cohorts[schedule.front()].deadline <= now){
+
+        std::pop_heap(schedule.begin(), schedule.end(), later);
+        TickCohort &cohort = cohorts[schedule.back()];
+
+        for(BehaviourGroup *group : cohort.groups)
+            group->update(); // one Python call per vectorized behaviour
+        for(Channel *channel : cohort.channels)
+            if(channel->evaluate())
+                tick_ready.push_back(channel);
+
+        // next multiple of the period from the previous deadline: no drift
+        // with the execution time, periods missed (overload) are skipped
+        uint64_t period = cohort.period * 1000000ULL;
+        cohort.deadline += period;
+        if(cohort.deadline <= now)
+            cohort.deadline += ((now - cohort.deadline) / period + 1) * period;
+        std::push_heap(schedule.begin(), schedule.end(), later);
     }
+    if(tick_ready.empty())
+        return;
+
+    mappingLock().writeLock();
+    for(Channel *channel : tick_ready)
+        channel->publish();
+    mappingLock().writeUnlock();
+}
+
+// The eager channels (lazy ones are evaluated when read, see refreshChannels)
+// whose behaviour implements updateValue and getValue, one cohort per period,
+// all due now.
+void WServer::buildTick(){
+
+    const unsigned required = CAN_UPDATE | CAN_GET;
+    uint64_t now = cNanoseconds();
+    std::unordered_map<unsigned, size_t> by_period;
+    cohorts.clear();
+    for(Channel *channel : channels){
+        if(channel->getTTL() > 0)
+            continue;
+        if((channel->getCapabilities() & required) != required){
+            CLOG(llWarning, "Channel %s: Python object doesn't have 'updateValue'/'getValue' method.", channel->getName().c_str());
+            continue;
+        }
+        unsigned period = channel->getPeriod() > 0 ? channel->getPeriod() : update_period;
+        auto it = by_period.find(period);
+        if(it == by_period.end()){
+            it = by_period.insert({period, cohorts.size()}).first;
+            cohorts.push_back(TickCohort{period, now, {}, {}});
+        }
+        TickCohort &cohort = cohorts[it->second];
+        cohort.channels.push_back(channel);
+        BehaviourGroup *group = channel->getBehaviourGroup();
+        if(group != nullptr && std::find(cohort.groups.begin(), cohort.groups.end(), group) == cohort.groups.end())
+            cohort.groups.push_back(group);
+    }
+
+    schedule.clear();
+    for(size_t i = 0; i < cohorts.size(); i++)
+        schedule.push_back(i);
+    std::make_heap(schedule.begin(), schedule.end(),
+                   [this](size_t a, size_t b){ return cohorts[a].deadline > cohorts[b].deadline; });
+    tick_dirty = false;
+}
+
+// Deadline (cNanoseconds) of the next updateChannels with channels to update:
+// now if the cohorts are to be built, UINT64_MAX if there is none.
+uint64_t WServer::nextUpdate(){
+
+    if(tick_dirty)
+        return 0;
+    if(schedule.empty())
+        return UINT64_MAX;
+    return cohorts[schedule.front()].deadline;
+}
+
+// Mask Write Register (0x16): the channel gets the value the write committed,
+// queued within its critical section (see cMODBUSServer::writePDU), so
+// concurrent masks reach the behaviour in the order they were applied.
+void WServer::OnMaskWrite(int address, uint16_t value){
+
+    for(Channel *channel : getChannels(HOLDINGREGISTER, address))
+        queueWrite(channel, address, &value, 1);
+}
+
+// Network threads: evaluates the lazy channels covering [address, address+n[
+// whose value is older than their TTL, so idle channels cost nothing. The
+// GIL is only taken if one is stale (the behaviour thread releases it while
+// waiting, see Wrapper::start).
+void WServer::refreshChannels(Rtype rtype, int address, int n){
+
+    vector<Channel*> stale;
+    uint64_t now = cMilliseconds();
+    int last_reg = std::min(address + n, (int)channel_index[rtype].size());
+    for(int reg = address; reg < last_reg; reg++)
+        for(Channel *channel : getChannels(rtype, reg))
+            if(channel->getTTL() > 0 && channel->isStale(now) &&
+               std::find(stale.begin(), stale.end(), channel) == stale.end())
+                stale.push_back(channel);
+    if(stale.empty())
+        return;
+
+    py::gil_scoped_acquire acquire;
+    now = cMilliseconds();
+    for(Channel *channel : stale)
+        if(channel->isStale(now)) // not refreshed while waiting for the GIL
+            channel->updateValue();
 }
 
 
 Channel* WServer::getChannel(std::string name){
 
-    for(int i=0; i<channels.size(); i++){
+    for(size_t i=0; i<channels.size(); i++){
         if(channels[i]->getName() == name){
             return channels[i];
         }
@@ -150,3 +442,27 @@ Channel* WServer::getChannel(std::string name){
     return nullptr;
 }
 
+
+// The group of the channels of this server using the vectorized behaviour
+// 'behaviour_class' with update 'period' (created on its first channel): a
+// group is updated once per period of all its channels (see buildTick).
+BehaviourGroup* WServer::getBehaviourGroup(py::object behaviour_class, unsigned period){
+
+    for(const std::unique_ptr<BehaviourGroup> &group : groups)
+        if(group->getClass().is(behaviour_class) && group->getPeriod() == period)
+            return group.get();
+    groups.emplace_back(new BehaviourGroup(behaviour_class, period));
+    return groups.back().get();
+}
+
+
+// Every channel covering 'address' (none if out of the index).
+const vector<Channel*>& WServer::getChannels(Rtype rtype, int address){
+
+    static const vector<Channel*> none;
+    const vector<vector<Channel*>> &index = channel_index[rtype];
+    if(address < 0 || address >= (int)index.size())
+        return none;
+    return index[address];
+}
+
@@ -4,40 +4,103 @@
 #include "channel.h"
 #include <modbus_.h>
 #include <vector>  
+#include <atomic>
+#include <memory>
 
 using namespace CUTIL;
 using namespace std;
 
+#define WRITE_QUEUE_SIZE 4096 // writes queued for the behaviours, per server
+#define CHANNEL_WRITE_MAX 2 // registers used by setBehaviourValue (FLOAT, INTEGER)
+
 class Channel;
 
 class WServer: public CUTIL::cMODBUSServer {
 
 public:
-    WServer(int iport); 
-	WServer(); 
+    WServer(int iport, CUTIL::cMODBUSReactor reactor=CUTIL::mrEpoll);
+	WServer(CUTIL::cMODBUSReactor reactor=CUTIL::mrEpoll);
+	~WServer();
 
 	void setID(int id){this->id = id;};
 	void setPort(int port){this->port = port;};
 	void setName(string name){this->name = name;};
+	void setWorkers(unsigned n){this->workers = n>0 ? n : 1;};
+	void setUnixSocket(string path){this->unix_socket = path;};
+	void setUdpWorkers(unsigned n){this->udp_workers = n;};
+	void setLazyTTL(unsigned ms){this->lazy_ttl = ms;};
+	void setUpdatePeriod(unsigned ms){this->update_period = ms>0 ? ms : 1000;};
+	// taken over from the previous process (see Wrapper::takeover), used by start()
+	void handover(const vector<int> &connections){ handed_connections.insert(handed_connections.end(), connections.begin(), connections.end()); };
+	void appendMappingImage(const char *data, size_t length){ mapping_image.append(data, length); };
 	int getID(){ return id; };
     int getPort(){ return port; };
     std::string getName(){ return name; };
+    unsigned getWorkers(){ return workers; };
 	void addChannel(Channel *channel);
 	Channel* getChannel(std::string name);
+	const vector<Channel*>& getChannels(Rtype rtype, int address);
+	BehaviourGroup* getBehaviourGroup(py::object behaviour_class, unsigned period);
 
 	void start();
 
 	void updateChannels();
-	void OnRequest(unsigned req_length) override;
+	void buildTick();
+	uint64_t nextUpdate();
+	void invalidateTick(){ tick_dirty = true; };
+	void refreshChannels(Rtype rtype, int address, int n);
+	void applyWrites();
+	void logStatistics();
+	int getWriteEvent(){ return write_event; };
+	void OnRequest(const uint8_t *req, unsigned req_length) override;
+	void OnMaskWrite(int address, uint16_t value) override;
 
 	vector<Channel*> getChannels(){return channels;};
 
 private:
     vector<Channel*> channels; 
+	vector<vector<Channel*>> channel_index[4]; // per Rtype: address -> every channel covering it (see addChannel)
 	int port;
 	string name;
 	int max_register;
 	int id;
+	unsigned workers; // SO_REUSEPORT listening sockets/threads
+	string unix_socket; // optional AF_UNIX listener (co-located clients)
+	unsigned udp_workers; // Modbus/UDP on the same port (0: disabled)
+	unsigned lazy_ttl; // default TTL (ms) of the channels, 0: eager (see refreshChannels)
+	unsigned lazy_channels; // channels with a TTL
+	unsigned update_period; // default period (ms) of the eager channels
+	// eager channels (TTL 0) whose behaviour can be updated, by period, built
+	// on the first tick after addChannel or a behaviour change; the cohorts
+	// are scheduled on absolute deadlines (see updateChannels)
+	struct TickCohort {
+		unsigned period; // ms
+		uint64_t deadline; // next update, cNanoseconds (CLOCK_MONOTONIC)
+		vector<Channel*> channels;
+		vector<BehaviourGroup*> groups; // vectorized behaviours of 'channels'
+	};
+	vector<TickCohort> cohorts;
+	vector<size_t> schedule; // min-heap of 'cohorts' by deadline
+	vector<std::unique_ptr<BehaviourGroup>> groups; // vectorized behaviours (see getBehaviourGroup)
+	vector<Channel*> tick_ready; // evaluated in the current tick
+	bool tick_dirty;
+	vector<int> handed_connections; // see handover()
+	string mapping_image; // see appendMappingImage()
+
+	// writes from the masters, queued by the network threads (OnRequest) and
+	// handed to the behaviours by the behaviour thread (applyWrites)
+	struct ChannelWrite {
+		Channel *channel;
+		int first_register; // of 'values', the registers written to the channel
+		int n;
+		uint16_t values[CHANNEL_WRITE_MAX];
+	};
+	CUTIL::cMPSCQueue<ChannelWrite> write_queue; // WRITE_QUEUE_SIZE, preallocated
+	std::atomic<bool> write_pending;
+	std::atomic<uint64_t> write_drops; // writes lost to a full write_queue
+	int write_event; // eventfd, readable when writes are queued
+	CUTIL::cHistogram writeback_latency; // ns per behaviour setValue (behaviour thread)
+	void queueWrite(Channel *channel, int first_register, const uint16_t *values, int n);
 };
 
 
@@ -1,9 +1,30 @@
 #include "wrapper.h"
 #include "channel.h"
 #include <numeric> // For std::accumulate
-
-
-Wrapper::Wrapper(){
+#include <map>
+#include <chrono>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <stddef.h> // offsetof
+#include <net_.h>
+
+#define HANDOFF_MAX_FDS 250      // descriptors per record (SCM_MAX_FD is 253)
+#define HANDOFF_CHUNK 32768      // mapping image bytes per record
+#define HANDOFF_DRAIN_TIMEOUT 30 // s, the clients left are then disconnected
+
+// Handoff request (new -> old process, 1 byte) and records (old -> new, one
+// SOCK_SEQPACKET message each: header, payload and attached descriptors).
+enum HandoffRequest { hrConnections = 1, hrMapping = 2 };
+enum HandoffKind { hkListeners = 'L', hkConnections = 'C', hkMapping = 'M', hkEnd = 'E' };
+struct HandoffHeader { int32_t kind; int32_t port; };
+
+
+Wrapper::Wrapper():handoff_connections(true),handoff_mapping(true),stats_period(0),native_behaviours(true){
     //readCSV();
 	//processCSV();
 }
@@ -41,6 +62,14 @@ void Wrapper::processCSV(){
 	int server_id_idx = 0;
 	int server_name_idx = 1;
 	int server_port_idx = 3;
+	int server_workers_idx = 4; // optional
+	int server_reactor_idx = 5; // optional
+	int server_idle_idx = 6; // optional
+	int server_max_conn_idx = 7; // optional
+	int server_unix_idx = 8; // optional
+	int server_udp_idx = 9; // optional
+	int server_lazy_idx = 10; // optional
+	int server_period_idx = 11; // optional
 
 	int channel_server_idx = 1;
 	int channel_name_idx = 2;
@@ -71,11 +100,32 @@ void Wrapper::processCSV(){
 			int serverPort = std::stoi(cReplace(row[server_port_idx], " ", ""));
 			//std::cout << "Adding server: " << serverID << " " << serverName << " " << serverPort << "\n";
 
-			WServer* server = new WServer();
+			CUTIL::cMODBUSReactor reactor = CUTIL::mrEpoll;
+			if ((int)row.size() > server_reactor_idx){
+				std::string r = cReplace(row[server_reactor_idx], " ", "");
+				if (r == "select") reactor = CUTIL::mrSelect;
+				else if (r == "uring") reactor = CUTIL::mrUring;
+			}
+
+			WServer* server = new WServer(reactor);
 
 			server->setName(serverName);
 			server->setID(serverID);
 			server->setPort(serverPort);
+			if ((int)row.size() > server_workers_idx && cReplace(row[server_workers_idx], " ", "").size() > 0)
+				server->setWorkers(std::stoi(cReplace(row[server_workers_idx], " ", "")));
+			if ((int)row.size() > server_idle_idx && cReplace(row[server_idle_idx], " ", "").size() > 0)
+				server->setIdleTimeout(std::stoi(cReplace(row[server_idle_idx], " ", "")));
+			if ((int)row.size() > server_max_conn_idx && cReplace(row[server_max_conn_idx], " ", "").size() > 0)
+				server->setMaxConnections(std::stoi(cReplace(row[server_max_conn_idx], " ", "")));
+			if ((int)row.size() > server_unix_idx && cReplace(row[server_unix_idx], " ", "").size() > 0)
+				server->setUnixSocket(cReplace(row[server_unix_idx], " ", ""));
+			if ((int)row.size() > server_udp_idx && cReplace(row[server_udp_idx], " ", "").size() > 0)
+				server->setUdpWorkers(std::stoi(cReplace(row[server_udp_idx], " ", "")));
+			if ((int)row.size() > server_lazy_idx && cReplace(row[server_lazy_idx], " ", "").size() > 0)
+				server->setLazyTTL(std::stoi(cReplace(row[server_lazy_idx], " ", "")));
+			if ((int)row.size() > server_period_idx && cReplace(row[server_period_idx], " ", "").size() > 0)
+				server->setUpdatePeriod(std::stoi(cReplace(row[server_period_idx], " ", "")));
 
 			addServer(server);
 
@@ -98,7 +148,18 @@ void Wrapper::processCSV(){
 			char* cbehaviour  = new char[behaviour.size() + 1];
 			std::strcpy(cbehaviour, behaviour.c_str());
 
-			std::vector<std::string> params_out = std::vector<std::string>(row.begin() + channel_param_idx, row.end());
+			std::vector<std::string> params_out;
+			unsigned ttl = 0, period = 0;
+			for (auto it = row.begin() + channel_param_idx; it != row.end(); ++it) {
+				// channel options among the behaviour parameters: ttl=<ms>, period=<ms>
+				std::string option = cReplace(*it, " ", "");
+				if (option.compare(0, 4, "ttl=") == 0)
+					ttl = std::stoi(option.substr(4));
+				else if (option.compare(0, 7, "period=") == 0)
+					period = std::stoi(option.substr(7));
+				else
+					params_out.push_back(*it);
+			}
 
 			// Output the parameters in a single sentence
     		std::cout << "\tServer ID = " << serverID
@@ -111,15 +172,30 @@ void Wrapper::processCSV(){
 					<< ", Behaviour = " << cbehaviour << std::endl;
 
 			Channel* channel = new Channel(starting_reg, n_reg, regtype, datatype, endian);
+			channel->setTTL(ttl);
+			channel->setPeriod(period);
 			
-			channel->setBehaviour(cbehaviour, params_out);
+			WServer* server = nullptr;
+			for(size_t i=0; i<servers_o.size() && server == nullptr; i++){
+				if(servers_o[i]->getID() == serverID)
+					server = servers_o[i];
+			}
+
+			// native implementation first (see behaviour.h), then Behaviours.py:
+			// one object per channel, or one group per server if vectorized
+			Behaviour* native = native_behaviours ? createBehaviour(behaviour, params_out) : nullptr;
+			py::object python_class = native ? py::none() : py::module_::import("Behaviours").attr(cbehaviour);
+			if (native)
+				channel->setBehaviour(native);
+			else if (server && py::hasattr(python_class, "vectorized") && python_class.attr("vectorized").cast<bool>()) {
+				BehaviourGroup* group = server->getBehaviourGroup(python_class, period);
+				channel->setBehaviour(group, group->add(params_out));
+			} else
+				channel->setBehaviour(cbehaviour, params_out);
 			channel->setName(name);
 			
-			for(int i=0; i<servers_o.size(); i++){
-				if(servers_o[i]->getID() == serverID){
-					servers_o[i]->addChannel(channel);
-				}
-			}
+			if (server)
+				server->addChannel(channel);
 		}
 
 
@@ -147,9 +223,10 @@ void Wrapper::addServer(WServer *server){
 void Wrapper::printStatus(){
 	std::cout << "Servers: "<< std::endl;
 
-		for(int i=0; i<servers_o.size(); i++){
+		for(size_t i=0; i<servers_o.size(); i++){
 		std::cout << "\tId: " << servers_o[i]->getID()
 				  << ", Port: " << servers_o[i]->getPort()
+		          << ", Workers: " << servers_o[i]->getWorkers()
 		          << ", N Channels: " << servers_o[i]->getChannels().size()
 		          << ", Max holding: " << servers_o[i]->getMaxRegister()
 		          << ", Max coil: " << servers_o[i]->getMaxCoil()
@@ -161,12 +238,290 @@ void Wrapper::printStatus(){
 }
 
 
+// Earliest channel update deadline of the servers (cNanoseconds, see
+// WServer::nextUpdate).
+uint64_t Wrapper::nextUpdate(){
+	uint64_t next = UINT64_MAX;
+	for(size_t i=0; i<servers_o.size(); i++)
+		next = std::min(next, servers_o[i]->nextUpdate());
+	return next;
+}
+
+// Arms 'timer' (timerfd) to expire at the absolute CLOCK_MONOTONIC time
+// 'deadline' (ns, already expired if in the past), UINT64_MAX disarms it.
+static void armTimer(int timer, uint64_t deadline){
+	itimerspec spec = {};
+	if (deadline != UINT64_MAX) {
+		spec.it_value.tv_sec = deadline / 1000000000ULL;
+		spec.it_value.tv_nsec = deadline % 1000000000ULL;
+		if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+			spec.it_value.tv_nsec = 1; // 0 would disarm
+	}
+	timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+WServer* Wrapper::getServerByPort(int port){
+	for(size_t i=0; i<servers_o.size(); i++){
+		if(servers_o[i]->getPort() == port)
+			return servers_o[i];
+	}
+	return nullptr;
+}
+
+/*
+ * Zero-downtime restart: the new process connects to the handoff socket of
+ * the running one and takes over its listening sockets (and, if requested,
+ * its idle connections and register maps). The old process then serves the
+ * connections it kept until they are closed and exits.
+ */
+void Wrapper::setHandoff(string path, bool connections, bool mapping){
+	handoff_path = path;
+	handoff_connections = connections;
+	handoff_mapping = mapping;
+}
+
+static socklen_t handoffAddress(const string &path, sockaddr_un &addr){
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	size_t length = std::min(path.size(), sizeof(addr.sun_path) - 1);
+	memcpy(addr.sun_path, path.c_str(), length);
+	if (path[0] == '@') addr.sun_path[0] = '\0'; // abstract namespace
+	return offsetof(sockaddr_un, sun_path) + length;
+}
+
+static bool sendRecord(int peer, HandoffKind kind, int port, const char *data, size_t length,
+	const int *fds = nullptr, unsigned nFds = 0){
+	HandoffHeader header = {kind, port};
+	string record(reinterpret_cast<const char*>(&header), sizeof(header));
+	record.append(data, length);
+	return cSendFds(peer, record.data(), record.size(), fds, nFds);
+}
+
+// the new process gets its own copies: 'fds' are still the caller's
+static bool sendSockets(int peer, HandoffKind kind, int port, const vector<int> &fds){
+	bool ok = true;
+	for (size_t at = 0; at < fds.size() && ok; at += HANDOFF_MAX_FDS)
+		ok = sendRecord(peer, kind, port, nullptr, 0, fds.data() + at,
+			std::min<size_t>(HANDOFF_MAX_FDS, fds.size() - at));
+	return ok;
+}
+
+static void closeSockets(vector<int> &fds){
+	for (int fd : fds) close(fd);
+	fds.clear();
+}
+
+// New process: returns false if there is no previous process to take over,
+// or if the handoff did not complete (the previous process then keeps
+// serving its connections: only the shared listening sockets are kept).
+bool Wrapper::takeover(){
+	sockaddr_un addr;
+	socklen_t length = handoffAddress(handoff_path, addr);
+	int peer = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (peer == -1) return false;
+	if (connect(peer, (struct sockaddr*)&addr, length) == -1) {
+		close(peer);
+		return false;
+	}
+	char request = (handoff_connections ? hrConnections : 0) | (handoff_mapping ? hrMapping : 0);
+	if (send(peer, &request, 1, MSG_NOSIGNAL) != 1) {
+		close(peer);
+		return false;
+	}
+
+	vector<char> buffer(sizeof(HandoffHeader) + HANDOFF_CHUNK);
+	unsigned nListeners = 0, nConnections = 0;
+	// connections and images are only handed to the servers once complete
+	std::map<WServer*, vector<int>> connections;
+	std::map<WServer*, string> images;
+	bool end = false;
+	while (!end) {
+		vector<int> fds;
+		HandoffHeader header;
+		ssize_t n = cRecvFds(peer, buffer.data(), buffer.size(), fds);
+		if (n < (ssize_t)sizeof(header)) { // previous process failed or is gone
+			for (int fd : fds) close(fd);
+			break;
+		}
+		memcpy(&header, buffer.data(), sizeof(header));
+		WServer *server = getServerByPort(header.port);
+		switch (header.kind) {
+			case hkListeners: // matched by address when connecting
+				nListeners += fds.size();
+				cMODBUSServer::inherit(fds);
+				fds.clear();
+				break;
+			case hkConnections:
+				if (server) {
+					nConnections += fds.size();
+					connections[server].insert(connections[server].end(), fds.begin(), fds.end());
+					fds.clear();
+				}
+				break;
+			case hkMapping:
+				if (server) images[server].append(buffer.data() + sizeof(header), n - sizeof(header));
+				break;
+			case hkEnd:
+				end = true;
+				break;
+		}
+		for (int fd : fds) close(fd); // server no longer configured
+	}
+	close(peer);
+	if (!end) {
+		for (auto &handed : connections)
+			closeSockets(handed.second);
+		std::cerr << "Handoff interrupted: the previous process keeps its connections" << std::endl;
+		return false;
+	}
+	for (auto &handed : connections)
+		handed.first->handover(handed.second);
+	for (auto &image : images)
+		image.first->appendMappingImage(image.second.data(), image.second.size());
+	std::cout << "Took over " << nListeners << " listening socket(s) and " << nConnections
+	          << " connection(s) from the previous process" << std::endl;
+	return true;
+}
+
+// Old process: returns true once the servers are draining (the new process serves the port).
+// If any record cannot be sent, the handoff is aborted: the servers accept
+// again and serve the connections they gave away (the new process drops them).
+bool Wrapper::handoff(int peer){
+	char request;
+	if (recv(peer, &request, 1, 0) != 1) return false;
+
+	// listening sockets first: pending clients wait in their (shared) accept queues
+	bool ok = true;
+	for (size_t i=0; i<servers_o.size() && ok; i++) {
+		vector<int> fds = servers_o[i]->listeners();
+		ok = sendSockets(peer, hkListeners, servers_o[i]->getPort(), fds);
+		closeSockets(fds);
+	}
+	if (!ok) return false; // nothing drained yet
+
+	// the servers stop accepting until the drain is committed or canceled
+	vector<vector<int>> handed;
+	for (size_t i=0; i<servers_o.size() && ok; i++) {
+		handed.push_back(servers_o[i]->drain(request & hrConnections));
+		ok = sendSockets(peer, hkConnections, servers_o[i]->getPort(), handed.back());
+	}
+	if (request & hrMapping) {
+		for (size_t i=0; i<servers_o.size() && ok; i++) {
+			string image = servers_o[i]->mappingImage();
+			for (size_t at = 0; at < image.size() && ok; at += HANDOFF_CHUNK)
+				ok = sendRecord(peer, hkMapping, servers_o[i]->getPort(), image.data() + at,
+					std::min<size_t>(HANDOFF_CHUNK, image.size() - at));
+		}
+	}
+	ok = ok && sendRecord(peer, hkEnd, 0, nullptr, 0);
+
+	for (size_t i=0; i<handed.size(); i++) {
+		if (ok) {
+			servers_o[i]->commitDrain();
+			closeSockets(handed[i]); // the new process has its own copies
+		} else servers_o[i]->cancelDrain(handed[i]); // served again
+	}
+	if (!ok) std::cerr << "Handoff failed: still serving" << std::endl;
+	return ok;
+}
+
+int Wrapper::listenHandoff(){
+	sockaddr_un addr;
+	struct stat st;
+	socklen_t length = handoffAddress(handoff_path, addr);
+	// the file of the previous process (or a stale one) is replaced
+	if (handoff_path[0] != '@' && lstat(handoff_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(handoff_path.c_str());
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd == -1) return -1;
+	if (bind(fd, (struct sockaddr*)&addr, length) == -1 || listen(fd, 1) == -1) {
+		std::cerr << "Couldn't listen on handoff socket: " << handoff_path << "\n";
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
 void Wrapper::start(){
 
-	for(int i=0; i<servers_o.size(); i++){
+	if (!handoff_path.empty())
+		takeover();
+
+	for(size_t i=0; i<servers_o.size(); i++){
 		servers_o[i]->start();
 	}
-
-	servers_o[servers_o.size()-1]->wait();
-	
+	cMODBUSServer::releaseInherited(); // listening sockets no longer configured
+
+	int handoff_fd = handoff_path.empty() ? -1 : listenHandoff();
+	// behaviour thread: channels updated at their period, woken by a timer at
+	// the absolute deadline of the next one (CLOCK_MONOTONIC, see
+	// WServer::updateChannels); writes from the masters applied as soon as
+	// queued (see WServer::applyWrites)
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	vector<pollfd> fds;
+	for(size_t i=0; i<servers_o.size(); i++)
+		fds.push_back({servers_o[i]->getWriteEvent(), POLLIN, 0});
+	fds.push_back({timer_fd, POLLIN, 0});
+	fds.push_back({handoff_fd, POLLIN, 0}); // ignored by poll() if -1
+	uint64_t stats = cNanoseconds() + stats_period * 1000000000ULL;
+	while (true) {
+		uint64_t now = cNanoseconds();
+		if (nextUpdate() <= now) {
+			for(size_t i=0; i<servers_o.size(); i++)
+				servers_o[i]->updateChannels();
+		}
+		if (stats_period > 0 && now >= stats) {
+			for(size_t i=0; i<servers_o.size(); i++)
+				servers_o[i]->logStatistics();
+			stats = now + stats_period * 1000000000ULL;
+		}
+		armTimer(timer_fd, stats_period > 0 ? std::min(nextUpdate(), stats) : nextUpdate());
+		int ready;
+		{
+			py::gil_scoped_release release; // lazy channels are evaluated by the network threads
+			ready = poll(fds.data(), fds.size(), -1);
+		}
+		if (ready <= 0) continue;
+		uint64_t expirations;
+		if (fds[servers_o.size()].revents & POLLIN)
+			if (read(timer_fd, &expirations, sizeof(expirations)) == -1) { } // re-armed above
+		for(size_t i=0; i<servers_o.size(); i++)
+			if (fds[i].revents & POLLIN)
+				servers_o[i]->applyWrites();
+		if (!(fds.back().revents & POLLIN)) continue;
+		int peer = accept4(handoff_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (peer == -1) continue;
+		bool handed = handoff(peer);
+		close(peer);
+		if (handed) break;
+	}
+	close(handoff_fd);
+	close(timer_fd);
+
+	// drain: serve the connections kept until closed (or the timeout)
+	std::cout << "Handed over to the new process, draining" << std::endl;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(HANDOFF_DRAIN_TIMEOUT);
+	for (bool active = true; active && std::chrono::steady_clock::now() < deadline; ) {
+		active = false;
+		for(size_t i=0; i<servers_o.size(); i++) {
+			if (servers_o[i]->active()) {
+				active = true;
+				servers_o[i]->updateChannels();
+			}
+		}
+		// until the next update, checking the connections every second at least
+		uint64_t now = cNanoseconds();
+		uint64_t wake = std::min<uint64_t>(nextUpdate(), now + 1000000000ULL);
+		py::gil_scoped_release release;
+		if (wake > now)
+			std::this_thread::sleep_for(std::chrono::nanoseconds(wake - now));
+	}
+	for(size_t i=0; i<servers_o.size(); i++) {
+		servers_o[i]->disconnect();
+		{
+			py::gil_scoped_release release;
+			servers_o[i]->wait();
+		}
+		servers_o[i]->applyWrites();
+	}
 }
\ No newline at end of file
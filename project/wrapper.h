@@ -16,11 +16,24 @@ public:
 	void readCSV(char *filenamepath);
 	void processCSV();
 	void printStatus();
+	void setHandoff(string path, bool connections=true, bool mapping=true);
+	void setStatsPeriod(unsigned seconds){ stats_period = seconds; };
+	void setNativeBehaviours(bool enabled){ native_behaviours = enabled; };
 	void start();
 private:
 	vector<vector<string>> csvRows;
 
 	void addServer(WServer *server);
+	WServer* getServerByPort(int port);
+	bool takeover();
+	bool handoff(int peer);
+	int listenHandoff();
+	uint64_t nextUpdate();
+
+	string handoff_path; // AF_UNIX socket of the zero-downtime restart (see start())
+	bool handoff_connections, handoff_mapping;
+	unsigned stats_period; // s between statistics logs (0: never)
+	bool native_behaviours; // built in behaviours in C++ rather than Behaviours.py
 
 	std::vector<WServer*> servers_o;
 	
@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+# End-to-end test of the RTU serving loop (cMODBUSServer::executeRTU) over a
+# local pty pair: rtu_server serves the slave side, this script is the master.
+# usage: rtu_loopback.py [rtu_server] [baud]   (exit status 1 on failure)
+import os, sys, struct, time, subprocess, tty, select
+
+server = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(__file__), 'rtu_server')
+baud = sys.argv[2] if len(sys.argv) > 2 else '9600'
+SLAVE = 17
+
+def crc16(data):
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0xA001 if crc & 1 else crc >> 1
+    return crc
+
+def frame(slave, pdu):
+    adu = bytes([slave]) + pdu
+    crc = crc16(adu)
+    return adu + bytes([crc & 0xFF, crc >> 8])
+
+def read_reply(master, timeout=0.5):
+    # the reply ends with a silence on our side too
+    out = b''
+    end = time.time() + timeout
+    while time.time() < end:
+        ready, _, _ = select.select([master], [], [], 0.02)
+        if ready:
+            out += os.read(master, 512)
+            end = time.time() + 0.02
+    return out
+
+master, slave = os.openpty()
+tty.setraw(master)
+tty.setraw(slave)
+process = subprocess.Popen([server, os.ttyname(slave), baud, '4'])
+time.sleep(0.5)
+
+def ask(slave_id, pdu, split=False):
+    request = frame(slave_id, pdu)
+    if split: # a pause shorter than 3.5 chars: still one frame
+        os.write(master, request[:3])
+        time.sleep(0.0005)
+        os.write(master, request[3:])
+    else:
+        os.write(master, request)
+    return read_reply(master)
+
+failures = 0
+def check(name, reply, expected_pdu):
+    global failures
+    expected = frame(SLAVE, expected_pdu) if expected_pdu is not None else b''
+    ok = reply == expected
+    failures += not ok
+    print('%-28s %s' % (name, 'ok' if ok else 'FAILED: got %s, expected %s' % (reply.hex(), expected.hex())))
+
+check('read holding registers', ask(SLAVE, struct.pack('>BHH', 3, 10, 4)),
+      struct.pack('>BB4H', 3, 8, 30, 33, 36, 39))
+check('read coils', ask(SLAVE, struct.pack('>BHH', 1, 0, 10)), bytes([1, 2, 0x49, 0x02]))
+check('write single register', ask(SLAVE, struct.pack('>BHH', 6, 10, 777)), struct.pack('>BHH', 6, 10, 777))
+check('read after write', ask(SLAVE, struct.pack('>BHH', 3, 10, 1)), struct.pack('>BBH', 3, 2, 777))
+check('illegal address', ask(SLAVE, struct.pack('>BHH', 3, 198, 5)), bytes([0x83, 2]))
+check('foreign slave (no reply)', ask(5, struct.pack('>BHH', 3, 10, 1)), None)
+check('broadcast (no reply)', ask(0, struct.pack('>BHH', 6, 11, 5)), None)
+check('read after broadcast', ask(SLAVE, struct.pack('>BHH', 3, 11, 1)), struct.pack('>BBH', 3, 2, 5))
+bad = bytearray(frame(SLAVE, struct.pack('>BHH', 3, 10, 1)))
+bad[-1] ^= 1
+os.write(master, bytes(bad))
+check('bad CRC (no reply)', read_reply(master), None)
+check('split frame', ask(SLAVE, struct.pack('>BHH', 3, 10, 2), split=True),
+      struct.pack('>BB2H', 3, 4, 777, 5))
+
+process.wait()
+if process.returncode != 0:
+    print('server exit status %d' % process.returncode)
+    failures += 1
+sys.exit(1 if failures else 0)
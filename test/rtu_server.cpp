@@ -0,0 +1,35 @@
+// RTU server for the loopback test (see rtu_loopback.py): slave 17 on the
+// serial device given, holding register i = 3*i, coil i set if i%3 == 0.
+// usage: rtu_server <device> <baud> <seconds>
+#include <modbus_.h>
+#include <unistd.h>
+#include <cstdlib>
+
+using namespace CUTIL;
+
+class TestServer: public CUTIL::cMODBUSServer {
+public:
+    TestServer():CUTIL::cMODBUSServer(1){}
+    void OnRequest(const uint8_t *, unsigned) override {}
+};
+
+int main(int argc, char **argv){
+
+    if (argc < 4)
+        return 2;
+    TestServer server;
+    server.setMaxRegister(200);
+    server.setMaxCoil(100);
+    server.setMaxInput(50);
+    server.setMaxDiscrete(20);
+    server.connect_RTU(17, argv[1], atoi(argv[2]), 'N', 8, 1);
+    for (int i = 0; i < 200; i++)
+        server.getMapping()->tab_registers[i] = i * 3;
+    for (int i = 0; i < 100; i++)
+        server.getMapping()->tab_bits[i] = i % 3 == 0;
+    server.execute();
+    sleep(atoi(argv[3]));
+    server.disconnect();
+    server.wait();
+    return 0;
+}
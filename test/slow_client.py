@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+# A client that never reads its replies must not delay the other clients of
+# the same worker: it pipelines requests until its own socket is full, then
+# another client is served as usual (see cMODBUSServer::flush).
+# usage: slow_client.py [tcp_server] [port]   (exit status 1 on failure)
+import os, sys, socket, struct, time, subprocess
+
+server = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(__file__), 'tcp_server')
+port = int(sys.argv[2]) if len(sys.argv) > 2 else 15020
+REACTORS = ['select', 'epoll', 'io_uring']
+
+def request(tid, address, count):
+    return struct.pack('>HHHBBHH', tid, 0, 6, 1, 3, address, count)
+
+def read_reply(sock, length):
+    out = b''
+    while len(out) < length:
+        chunk = sock.recv(length - len(out))
+        if not chunk:
+            break
+        out += chunk
+    return out
+
+failures = 0
+for reactor, name in enumerate(REACTORS):
+    process = subprocess.Popen([server, str(port), str(reactor), '3'])
+    time.sleep(0.3)
+    # the slow client: 125 registers per reply, never read ..................
+    slow = socket.create_connection(('127.0.0.1', port))
+    slow.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+    slow.setblocking(False)
+    batch, queued = request(1, 0, 125) * 1000, 0
+    try:
+        while queued < 64 * 1024 * 1024: # whole frames only
+            queued += slow.send(batch[queued % len(batch):])
+    except BlockingIOError:
+        pass
+    time.sleep(0.2)
+    # another client is still served promptly ..............................
+    fast = socket.create_connection(('127.0.0.1', port))
+    fast.settimeout(1.0)
+    worst = 0.0
+    ok = queued > 0
+    for tid in range(50):
+        start = time.time()
+        try:
+            fast.sendall(request(tid, 10, 2))
+            reply = read_reply(fast, 13)
+        except OSError: # timeout or reset
+            reply = b''
+        worst = max(worst, time.time() - start)
+        ok = ok and reply == struct.pack('>HHHBBBHH', tid, 0, 7, 1, 3, 4, 30, 33)
+    ok = ok and worst < 0.1
+    # ... and the slow client gets its replies, in order, once it reads ....
+    slow.setblocking(True)
+    slow.settimeout(1.0)
+    expected = struct.pack('>HHHBBB', 1, 0, 253, 1, 3, 250) + struct.pack('>125H', *range(0, 375, 3))
+    try:
+        ok = ok and all(read_reply(slow, len(expected)) == expected for _ in range(100))
+    except OSError:
+        ok = False
+    failures += not ok
+    print('%-9s %s (slow client sent %d bytes, worst reply %.1f ms)' %
+          (name, 'ok' if ok else 'FAILED', queued, worst * 1000))
+    fast.close()
+    slow.close()
+    process.wait()
+    if process.returncode != 0:
+        print('server exit status %d' % process.returncode)
+        failures += 1
+sys.exit(1 if failures else 0)
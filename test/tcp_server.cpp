@@ -0,0 +1,31 @@
+// TCP server for the slow client test (see slow_client.py): holding register
+// i = 3*i on 127.0.0.1:<port>, served by the given reactor (0 select, 1 epoll,
+// 2 io_uring).
+// usage: tcp_server <port> <reactor> <seconds>
+#include <modbus_.h>
+#include <unistd.h>
+#include <cstdlib>
+
+using namespace CUTIL;
+
+class TestServer: public CUTIL::cMODBUSServer {
+public:
+    explicit TestServer(cMODBUSReactor reactor):CUTIL::cMODBUSServer(10, reactor){}
+    void OnRequest(const uint8_t *, unsigned) override {}
+};
+
+int main(int argc, char **argv){
+
+    if (argc < 4)
+        return 2;
+    TestServer server(static_cast<cMODBUSReactor>(atoi(argv[2])));
+    server.setMaxRegister(200);
+    server.connect_TCP("127.0.0.1", atoi(argv[1]), 16);
+    for (int i = 0; i < 200; i++)
+        server.getMapping()->tab_registers[i] = i * 3;
+    server.execute();
+    sleep(atoi(argv[3]));
+    server.disconnect();
+    server.wait();
+    return 0;
+}